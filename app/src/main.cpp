@@ -1,8 +1,24 @@
+#include <kaleidoscope/linker.hpp>
 #include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/pipeline.hpp>
+#include <kaleidoscope/server.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+#include <kaleidoscope/details/KaleidoscopeAOT.hpp>
 
+#include <llvm-12/llvm/ADT/SmallString.h>
+#include <llvm-12/llvm/ADT/StringSwitch.h>
+#include <llvm-12/llvm/Support/Path.h>
 #include <llvm-12/llvm/Support/TargetSelect.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <vector>
 
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern 'd" from user code.
@@ -27,58 +43,344 @@ extern "C" DLLEXPORT double printd(const double x)
 }
 
 ///// top ::= definition | external | expression | ';'
-void main_loop(hello_llvm::parser& parser)
+void main_loop(hello_llvm::parser& parser, const bool interactive)
 {
-	while (true)
+	const auto prompt = [interactive] {
+		if (interactive) { std::cerr << "ready> "; }
+		return true;
+	};
+
+	// At the prompt, '_' quits.
+	prompt();
+	parser.run_all([&](const hello_llvm::top_level_item&) { return prompt(); }, [](const int token) { return token != '_'; });
+}
+
+namespace
+{
+	/// usage - The command line, after the program name.
+	constexpr auto usage = "[-O0|-O1|-O2|-O3] [--mcpu CPU] [--mattr FEATURES] [--code-model MODEL] [--max-inline-size N] [--lazy | --tier-up N] "
+						   "[--no-interpreter] [--pipeline] [--jobs N] [--compile-threads N] [--object-cache DIR] [--huge-pages] [--memory-stats] "
+						   "[--dump-ir] [--emit-obj FILE] [--emit-shared FILE] [--serve SOCKET [--workers N] [--max-steps N]] [--help] [file...]";
+
+	/// options - What the command line asks for besides the set up of the JIT.
+	struct options
 	{
-		std::cerr << "ready> ";
-		switch (parser.get_next_token())
-		{
-			case '_':
-			case hello_llvm::tokenizer::tok_eof:
-				return;
-			case ';':// ignore top-level semicolons.
-				parser.get_next_token();
-				break;
-			case hello_llvm::tokenizer::tok_def:
-				parser.handle_definition();
-				break;
-			case hello_llvm::tokenizer::tok_extern:
-				parser.handle_extern();
-				break;
-			default:
-				parser.handle_top_level_expression();
-				break;
-		}
+		bool help				= false;
+		bool dump_ir			= false;
+		bool pipelined			= false;
+		bool memory_stats		= false;
+		const char* emit_obj	= nullptr;
+		const char* emit_shared = nullptr;
+		const char* serve		= nullptr;
+		unsigned workers		= 0;
+		std::uint64_t max_steps = 0;
+		std::optional<unsigned> jobs;
+	};
+
+	/// option - A flag, whether a value follows it, and what it does with that value.
+	/// apply returns false (after reporting why) if the value is not one it takes.
+	struct option
+	{
+		const char* name;
+		bool takes_value;
+		bool (*apply)(hello_llvm::session& session, options& opts, const char* value);
+	};
 
+	unsigned to_unsigned(const char* value)
+	{
+		return static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+	}
+
+	/// opt_level - Optimization level of the pass pipeline and code generator, -O2 by
+	/// default.
+	template<unsigned Level>
+	bool opt_level(hello_llvm::session& session, options&, const char*)
+	{
+		session.exit_on_error(session.jit->setOptLevel(Level));
+		return true;
 	}
-}
+
+	const option option_table[]{
+		{"-O0", false, opt_level<0>},
+		{"-O1", false, opt_level<1>},
+		{"-O2", false, opt_level<2>},
+		{"-O3", false, opt_level<3>},
+		// Target this CPU instead of the host one.
+		{"--mcpu", true, [](hello_llvm::session& session, options&, const char* value) {
+			 session.exit_on_error(session.jit->setCPU(value));
+			 return true;
+		 }},
+		// Comma separated features to enable (+) or disable (-), such as "+avx2,-fma".
+		{"--mattr", true, [](hello_llvm::session& session, options&, const char* value) {
+			 session.exit_on_error(session.jit->addFeatures(value));
+			 return true;
+		 }},
+		{"--code-model", true, [](hello_llvm::session& session, options&, const char* value) {
+			 const auto model = llvm::StringSwitch<llvm::Optional<llvm::CodeModel::Model>>(value)
+										.Case("tiny", llvm::CodeModel::Tiny)
+										.Case("small", llvm::CodeModel::Small)
+										.Case("kernel", llvm::CodeModel::Kernel)
+										.Case("medium", llvm::CodeModel::Medium)
+										.Case("large", llvm::CodeModel::Large)
+										.Default(llvm::None);
+			 if (!model)
+			 {
+				 std::cerr << "unknown code model " << value << ", expected tiny, small, kernel, medium or large\n";
+				 return false;
+			 }
+			 session.exit_on_error(session.jit->setCodeModel(model));
+			 return true;
+		 }},
+		// Largest function (in instructions) inlined into later modules, 0 disables it.
+		{"--max-inline-size", true, [](hello_llvm::session& session, options&, const char* value) {
+			 session.jit->setMaxInlineSize(to_unsigned(value));
+			 return true;
+		 }},
+		// Only compile functions the first time they are called.
+		{"--lazy", false, [](hello_llvm::session& session, options&, const char*) {
+			 session.jit->setLazy(true);
+			 return true;
+		 }},
+		// Compile quickly first, and optimize functions once called N times.
+		{"--tier-up", true, [](hello_llvm::session& session, options&, const char* value) {
+			 session.exit_on_error(session.jit->setTierUpThreshold(std::strtoull(value, nullptr, 10)));
+			 return true;
+		 }},
+		// Compile every top-level expression, however cheap.
+		{"--no-interpreter", false, [](hello_llvm::session& session, options&, const char*) {
+			 session.interpret_expressions = false;
+			 return true;
+		 }},
+		// Run top-level expressions on a thread of their own, while parsing goes on.
+		{"--pipeline", false, [](hello_llvm::session&, options& opts, const char*) {
+			 opts.pipelined = true;
+			 return true;
+		 }},
+		// Load the files in parallel, then link them. They only see each other's
+		// functions through externs. 0 picks one thread per hardware thread.
+		{"--jobs", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.jobs = to_unsigned(value);
+			 return true;
+		 }},
+		// Compile in the background, 0 picks one thread per hardware thread.
+		{"--compile-threads", true, [](hello_llvm::session& session, options&, const char* value) {
+			 const auto threads = to_unsigned(value);
+			 session.exit_on_error(session.jit->setCompileThreads(threads == 0 ? llvm::hardware_concurrency().compute_thread_count() : threads));
+			 return true;
+		 }},
+		// Reuse the objects of unchanged modules across runs.
+		{"--object-cache", true, [](hello_llvm::session& session, options&, const char* value) {
+			 session.exit_on_error(session.jit->getObjectCache().setDirectory(value));
+			 return true;
+		 }},
+		// Back the memory the code is loaded into with transparent huge pages.
+		{"--huge-pages", false, [](hello_llvm::session& session, options&, const char*) {
+			 session.jit->getMemoryPool().setHugePages(true);
+			 return true;
+		 }},
+		// Tell how the memory the code is loaded into was reused, at the end.
+		{"--memory-stats", false, [](hello_llvm::session&, options& opts, const char*) {
+			 opts.memory_stats = true;
+			 return true;
+		 }},
+		// Print the IR of every item when running files, as the prompt does.
+		{"--dump-ir", false, [](hello_llvm::session&, options& opts, const char*) {
+			 opts.dump_ir = true;
+			 return true;
+		 }},
+		// Also write the definitions to an object file, with a C header next to it.
+		{"--emit-obj", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.emit_obj = value;
+			 return true;
+		 }},
+		// Also write the definitions to a shared library, with a C header next to it.
+		{"--emit-shared", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.emit_shared = value;
+			 return true;
+		 }},
+		// Once the files are read, evaluate the expressions clients send to this socket.
+		{"--serve", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.serve = value;
+			 return true;
+		 }},
+		// Requests evaluated in parallel by the server, 0 picks one per hardware thread.
+		{"--workers", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.workers = to_unsigned(value);
+			 return true;
+		 }},
+		// Loop iterations and calls each request may take, no limit (and no counting) if 0.
+		{"--max-steps", true, [](hello_llvm::session&, options& opts, const char* value) {
+			 opts.max_steps = std::strtoull(value, nullptr, 10);
+			 return true;
+		 }},
+		// Print the usage and exit.
+		{"--help", false, [](hello_llvm::session&, options& opts, const char*) {
+			 opts.help = true;
+			 return true;
+		 }},
+	};
+}// namespace
 
 ////===----------------------------------------------------------------------===//
 //// Main driver code.
 ////===----------------------------------------------------------------------===//
 
-int main()
+int main(int argc, char* argv[])
 {
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
 	llvm::InitializeNativeTargetAsmParser();
 	llvm::InitializeNativeTargetDisassembler();
 
-	hello_llvm::parser		   parser{};
+	hello_llvm::session session;
+
+	std::vector<const char*> filenames;
+	options opts;
+	for (auto i = 1; i < argc; ++i)
+	{
+		if (argv[i][0] != '-')
+		{
+			filenames.push_back(argv[i]);
+			continue;
+		}
+
+		const auto* opt = std::find_if(std::begin(option_table), std::end(option_table), [&](const option& o) { return std::strcmp(o.name, argv[i]) == 0; });
+		if (opt == std::end(option_table) || (opt->takes_value && i + 1 == argc))
+		{
+			std::cerr << (opt == std::end(option_table) ? "unknown option " : "missing value for ") << argv[i] << "\nusage: " << argv[0] << ' ' << usage << '\n';
+			return 1;
+		}
+		if (!opt->apply(session, opts, opt->takes_value ? argv[++i] : nullptr)) { return 1; }
+	}
+
+	if (opts.help)
+	{
+		std::cout << "usage: " << argv[0] << ' ' << usage << '\n';
+		return 0;
+	}
+
+	if (opts.serve && opts.max_steps != 0)
+	{
+		// Before the library is added, so that its functions count their steps too.
+		session.exit_on_error(session.jit->setStepLimits(true));
+	}
 
-	// Install standard binary operators.
-	// 1 is the lowest precedence.
-	hello_llvm::global_context::add_bin_op_precedence('<', 10);
-	hello_llvm::global_context::add_bin_op_precedence('+', 20);
-	hello_llvm::global_context::add_bin_op_precedence('-', 20);
-	hello_llvm::global_context::add_bin_op_precedence('*', 40);// highest.
+	if (opts.emit_obj || opts.emit_shared)
+	{
+		// For the target and optimization level the options above settled on.
+		session.aot = session.exit_on_error(llvm::orc::KaleidoscopeAOT::Create(session.jit->getTargetMachineBuilder(), session.jit->getOptLevel()));
+	}
 
-	// Run the main "interpreter loop" now.
-	main_loop(parser);
+	std::optional<hello_llvm::expression_pipeline> pipeline;
+	if (opts.pipelined)
+	{
+		// Expressions are compiled in the background meanwhile, on one thread per
+		// hardware thread unless told otherwise.
+		session.exit_on_error(session.jit->setCompileThreads(llvm::hardware_concurrency().compute_thread_count()));
+		session.pipeline = &pipeline.emplace(session);
+	}
+
+	if (opts.jobs)
+	{
+		// What the files define is compiled on as many threads.
+		opts.jobs = *opts.jobs == 0 ? llvm::hardware_concurrency().compute_thread_count() : *opts.jobs;
+		session.exit_on_error(session.jit->setCompileThreads(*opts.jobs));
+	}
+
+	if (filenames.empty() && !opts.serve)
+	{
+		// Run the main "interpreter loop" now.
+		hello_llvm::parser parser{session};
+		main_loop(parser, true);
+	}
+	else
+	{
+		// Open them all first, a missing file is reported before anything runs.
+		std::vector<std::unique_ptr<hello_llvm::source>> sources;
+		for (const auto* filename: filenames)
+		{
+			sources.push_back(hello_llvm::mapped_file_source::open(filename));
+			if (!sources.back()) { return 1; }
+		}
+
+		// Batch mode: no prompts, no IR unless asked for, and the results go to the
+		// (buffered) standard output instead of stderr.
+		session.dump_ir			  = opts.dump_ir;
+		session.results			  = &std::cout;
+		// Files are typically long runs of definitions, compile them a batch at a time.
+		session.batch_definitions = true;
+
+		if (opts.jobs)
+		{
+			// Each on its own, their top-level expressions run once they are all linked.
+			hello_llvm::linker linker{session};
+			for (std::size_t i = 0; i < sources.size(); ++i) { linker.add(filenames[i], std::move(sources[i])); }
+			if (!linker.link(*opts.jobs)) { return 1; }
+		}
+		else
+		{
+			// One after the other, later files see the definitions of earlier ones.
+			for (auto& source: sources)
+			{
+				hello_llvm::parser parser{session, std::move(source)};
+				main_loop(parser, false);
+			}
+		}
+	}
+
+	if (pipeline)
+	{
+		// Every result is out before anything that follows.
+		pipeline->finish();
+		session.pipeline = nullptr;
+	}
+
+	// Hand the trailing definitions to the JIT.
+	session.flush_definitions();
+
+	if (opts.serve)
+	{
+		// The files above are the library every request can call into.
+		const auto workers = opts.workers == 0 ? llvm::hardware_concurrency().compute_thread_count() : opts.workers;
+		hello_llvm::server server{session, workers, opts.max_steps == 0 ? std::numeric_limits<std::uint64_t>::max() : opts.max_steps};
+		if (!server.run(opts.serve)) { return 1; }
+		server.print_stats(std::cerr);
+	}
+
+	if (session.aot)
+	{
+		// The header takes the name of the file it goes with, with a .h extension.
+		const auto header = [](const char* filename)
+		{
+			llvm::SmallString<128> path{llvm::StringRef{filename}};
+			llvm::sys::path::replace_extension(path, "h");
+			return path;
+		};
+
+		if (opts.emit_obj)
+		{
+			session.exit_on_error(session.aot->emitObject(opts.emit_obj));
+			session.exit_on_error(session.aot->emitHeader(header(opts.emit_obj)));
+		}
+		if (opts.emit_shared)
+		{
+			session.exit_on_error(session.aot->emitSharedLibrary(opts.emit_shared));
+			session.exit_on_error(session.aot->emitHeader(header(opts.emit_shared)));
+		}
+	}
+
+	if (const auto& cache = session.jit->getObjectCache(); cache.isEnabled())
+	{
+		cache.printStats(llvm::errs());
+	}
+
+	if (opts.memory_stats)
+	{
+		session.jit->getMemoryPool().printStats(llvm::errs());
+	}
 
 	// Print out all the generated code.
-	// hello_llvm::global_context::get().module->print(llvm::errs(), nullptr);
+	// session.module->print(llvm::errs(), nullptr);
 
 	return 0;
 }
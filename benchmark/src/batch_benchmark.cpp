@@ -0,0 +1,82 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/batch.hpp>
+#include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/Support/TargetSelect.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace hello_llvm::benchmark
+{
+	namespace
+	{
+		/// score - A typical row formula, branches included.
+		constexpr auto score_source =
+				"def score(a b c) if a < b then a * 0.5 + b * b * 0.25 - c else b * 0.5 - a * c * 0.125;";
+	}// namespace
+
+	void batch_benchmark()
+	{
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+
+		session s;
+		s.dump_ir = false;
+		{
+			parser p{s, std::make_unique<string_source>(score_source)};
+			p.get_next_token();
+			p.handle_definition();
+		}
+
+		const auto kernel = batch_kernel::compile(s, "score");
+		if (!kernel) { std::exit(1); }
+
+		constexpr std::size_t rows = 1 << 20;
+		constexpr auto repeat = 10;
+
+		// Structure of arrays, one column per parameter.
+		std::vector<double> a(rows), b(rows), c(rows);
+		for (std::size_t i = 0; i < rows; ++i)
+		{
+			a[i] = static_cast<double>(i % 1000) * 0.001;
+			b[i] = static_cast<double>((i * 7) % 1000) * 0.001;
+			c[i] = static_cast<double>((i * 13) % 1000) * 0.001;
+		}
+
+		const auto score = reinterpret_cast<double (*)(double, double, double)>(
+				static_cast<std::intptr_t>(s.exit_on_error(s.jit->lookup("score")).getAddress()));
+
+		std::vector<double> scalar_out(rows);
+		const auto scalar_time = best_of(repeat, [&] {
+			for (std::size_t i = 0; i < rows; ++i) { scalar_out[i] = score(a[i], b[i], c[i]); }
+		});
+
+		std::vector<double> batch_out(rows);
+		const double* const columns[]{a.data(), b.data(), c.data()};
+		const auto batch_time = best_of(repeat, [&] {
+			if (!(*kernel)(columns, batch_out.data(), rows)) { std::exit(1); }
+		});
+
+		if (batch_out != scalar_out)
+		{
+			std::cerr << "batch kernel results differ from the scalar calls\n";
+			std::exit(1);
+		}
+
+		const auto report = [&](const char* name, const double seconds) {
+			std::cout << std::setw(24) << std::left << name
+					  << std::setw(10) << std::right << std::fixed << std::setprecision(1) << static_cast<double>(rows) / seconds / 1e6 << " Mrows/s\n";
+		};
+
+		std::cout << rows << " rows of " << kernel->arity() << " columns, best of " << repeat << '\n';
+		report("call per row", scalar_time);
+		report("batch kernel", batch_time);
+		std::cout << "speedup: " << std::setprecision(2) << scalar_time / batch_time << "x\n";
+	}
+}// namespace hello_llvm::benchmark
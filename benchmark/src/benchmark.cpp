@@ -0,0 +1,27 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <memory>
+
+namespace hello_llvm::benchmark
+{
+	double run_expressions(const std::string& source, const llvm::function_ref<void(llvm::orc::KaleidoscopeJIT&)> configure)
+	{
+		session s;
+		s.dump_ir				= false;
+		s.results				= nullptr;
+		s.interpret_expressions = false;
+		configure(*s.jit);
+
+		parser p{s, std::make_unique<string_source>(source)};
+		auto sum = 0.0;
+		p.run_all([&sum](const top_level_item& item) {
+			sum += item.value.value_or(0.0);
+			return true;
+		});
+		s.jit->waitForCompiles();
+		return sum;
+	}
+}// namespace hello_llvm::benchmark
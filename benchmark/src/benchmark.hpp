@@ -0,0 +1,44 @@
+#ifndef HELLO_LLVM_BENCHMARK_HPP
+#define HELLO_LLVM_BENCHMARK_HPP
+
+#include <llvm-12/llvm/ADT/STLExtras.h>
+
+#include <chrono>
+#include <limits>
+#include <string>
+
+namespace llvm::orc
+{
+	class KaleidoscopeJIT;
+}// namespace llvm::orc
+
+namespace hello_llvm::benchmark
+{
+	/// best_of - Run `func` `repeat` times and return the fastest run in seconds.
+	template<typename Function>
+	double best_of(const int repeat, Function&& func)
+	{
+		auto best = std::numeric_limits<double>::max();
+		for (auto i = 0; i < repeat; ++i)
+		{
+			const auto begin = std::chrono::steady_clock::now();
+			func();
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+			if (elapsed.count() < best) { best = elapsed.count(); }
+		}
+		return best;
+	}
+
+	/// run_expressions - The sum of the top-level expressions of `source`, compiled by
+	/// a session of its own with the JIT set up by `configure`, once every compile
+	/// the JIT started in the background is done.
+	double run_expressions(const std::string& source, llvm::function_ref<void(llvm::orc::KaleidoscopeJIT&)> configure);
+
+	void lexer_benchmark();
+	void batch_benchmark();
+	void jit_memory_benchmark();
+	void compile_threads_benchmark();
+	void pipeline_benchmark();
+}// namespace hello_llvm::benchmark
+
+#endif//HELLO_LLVM_BENCHMARK_HPP
@@ -0,0 +1,89 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/Support/TargetSelect.h>
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+namespace hello_llvm::benchmark
+{
+	namespace
+	{
+		/// program - Definitions calling a common helper, then one expression calling
+		/// each, for the JIT to compile. The helper calls out of the program, so that
+		/// the constant folder cannot evaluate the expressions instead.
+		std::string program(const int definitions)
+		{
+			std::string source = "extern sin(x);\ndef g(x) x * sin(x) + 1;\n";
+			for (auto i = 0; i < definitions; ++i)
+			{
+				const auto n = std::to_string(i);
+				source += "def f" + n + "(x) if x < " + std::to_string(i % 7) + " then g(x) * 0.5 + x else g(x) - x * 0.25 + " + n + ";\n";
+			}
+			for (auto i = 0; i < definitions; ++i)
+			{
+				source += "f" + std::to_string(i) + "(" + std::to_string(i % 11) + ");\n";
+			}
+			return source;
+		}
+	}// namespace
+
+	void compile_threads_benchmark()
+	{
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+
+		constexpr auto definitions = 200;
+		const auto source = program(definitions);
+
+		struct configuration
+		{
+			const char* name;
+			unsigned threads;
+			bool lazy;
+		};
+		constexpr configuration configurations[]{
+				{"on the calling thread", 0, false},
+				{"2 compile threads", 2, false},
+				{"4 compile threads", 4, false},
+				{"lazy, 4 compile threads", 4, true},
+		};
+
+		std::cout << definitions << " definitions compiled and called, best of 3 ("
+				  << llvm::hardware_concurrency().compute_thread_count() << " hardware threads)\n";
+
+		double sums[std::size(configurations)];
+		for (std::size_t i = 0; i < std::size(configurations); ++i)
+		{
+			const auto& [name, threads, lazy] = configurations[i];
+			const auto seconds = best_of(3, [&] {
+				// Every definition is a module of its own, which starts compiling in the
+				// background as soon as it is added if there are compile threads. Nothing
+				// is inlined across modules, or the expressions would be optimized into
+				// constants and the definitions only compiled in the background.
+				sums[i] = run_expressions(source, [&](llvm::orc::KaleidoscopeJIT& jit) {
+					jit.setMaxInlineSize(0);
+					jit.setLazy(lazy);
+					if (auto err = jit.setCompileThreads(threads))
+					{
+						llvm::logAllUnhandledErrors(std::move(err), llvm::errs());
+						std::exit(1);
+					}
+				});
+			});
+			std::cout << std::setw(28) << std::left << name
+					  << std::setw(10) << std::right << std::fixed << std::setprecision(1) << definitions / seconds << " definitions/s\n";
+
+			if (sums[i] != sums[0])
+			{
+				std::cerr << name << " gives different results\n";
+				std::exit(1);
+			}
+		}
+	}
+}// namespace hello_llvm::benchmark
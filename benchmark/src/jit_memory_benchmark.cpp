@@ -0,0 +1,103 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm-12/llvm/Support/TargetSelect.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace hello_llvm::benchmark
+{
+	namespace
+	{
+		/// expressions - Each one different, not constant, and called into the JIT.
+		std::string expressions(const int count)
+		{
+			std::string source = "extern sin(x);\ndef f(x) x * x + sin(x);\n";
+			for (auto i = 0; i < count; ++i)
+			{
+				source += "f(" + std::to_string(i) + ") * sin(" + std::to_string(i % 97) + ") + " + std::to_string(i) + ";\n";
+			}
+			return source;
+		}
+
+		/// load_object - What RuntimeDyld does with the memory of a small object, the
+		/// code of a top-level expression, from allocation to removal.
+		void load_object(llvm::RuntimeDyld::MemoryManager& memory)
+		{
+			if (memory.needsToReserveAllocationSpace()) { memory.reserveAllocationSpace(3072, 16, 256, 8, 64, 8); }
+
+			auto* code = memory.allocateCodeSection(3072, 16, 0, ".text");
+			auto* eh_frame = memory.allocateDataSection(256, 8, 1, ".eh_frame", true);
+			auto* data = memory.allocateDataSection(64, 8, 2, ".data", false);
+			if (!code || !eh_frame || !data) { std::exit(1); }
+
+			std::memset(code, 0xc3, 3072);
+			std::memset(eh_frame, 0, 256);
+			std::memset(data, 0, 64);
+			if (memory.finalizeMemory()) { std::exit(1); }
+		}
+	}// namespace
+
+	void jit_memory_benchmark()
+	{
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+
+		constexpr auto objects = 100000;
+		constexpr auto repeat = 5;
+
+		const auto report = [](const char* name, const double per_second, const char* unit) {
+			std::cout << std::setw(28) << std::left << name
+					  << std::setw(10) << std::right << std::fixed << std::setprecision(1) << per_second << ' ' << unit << '\n';
+		};
+
+		std::cout << objects << " objects loaded and freed, best of " << repeat << '\n';
+		report("section memory manager", objects / 1e3 / best_of(repeat, [] {
+			for (auto i = 0; i < objects; ++i)
+			{
+				llvm::SectionMemoryManager memory;
+				load_object(memory);
+			}
+		}), "kobjects/s");
+
+		llvm::orc::KaleidoscopeMemoryPool pool;
+		report("pooled", objects / 1e3 / best_of(repeat, [&] {
+			for (auto i = 0; i < objects; ++i)
+			{
+				llvm::orc::PooledMemoryManager memory{pool};
+				load_object(memory);
+			}
+		}), "kobjects/s");
+		std::cout << std::flush;
+		pool.printStats(llvm::outs());
+		llvm::outs().flush();
+
+		// End to end, where compiling the expressions dominates.
+		constexpr auto count = 2000;
+		const auto source = expressions(count);
+		double sums[3];
+
+		std::cout << count << " top-level expressions compiled, run and freed, best of 3\n";
+		report("section memory manager", count / best_of(3, [&] {
+			sums[0] = run_expressions(source, [](llvm::orc::KaleidoscopeJIT& jit) { jit.setPooledMemory(false); });
+		}), "expressions/s");
+		report("pooled", count / best_of(3, [&] {
+			sums[1] = run_expressions(source, [](llvm::orc::KaleidoscopeJIT&) {});
+		}), "expressions/s");
+		report("pooled, huge pages", count / best_of(3, [&] {
+			sums[2] = run_expressions(source, [](llvm::orc::KaleidoscopeJIT& jit) { jit.getMemoryPool().setHugePages(true); });
+		}), "expressions/s");
+
+		if (sums[1] != sums[0] || sums[2] != sums[0])
+		{
+			std::cerr << "pooled memory gives different results\n";
+			std::exit(1);
+		}
+	}
+}// namespace hello_llvm::benchmark
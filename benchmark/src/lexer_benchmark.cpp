@@ -0,0 +1,136 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/lexer.hpp>
+
+#include <cctype>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace hello_llvm::benchmark
+{
+	namespace
+	{
+		/// view_source - Scans the benchmark input in place, so runs do not time a copy.
+		class view_source final : public source
+		{
+		public:
+			explicit view_source(const std::string_view view)
+			{
+				begin_ = view.data();
+				end_   = view.data() + view.size();
+			}
+		};
+
+		/// reference_get_token - The tokenizer as it classified characters before the
+		/// lookup tables: <cctype> calls and a chain of keyword compares, scanning the
+		/// same buffer by pointer and interning the same identifiers so only the
+		/// classification differs.
+		int reference_get_token(symbol_table& symbols, const char*& cursor, const char* const end, std::string_view& identifier_str, double& num_val)
+		{
+			const auto peek = [&] { return cursor == end ? EOF : static_cast<unsigned char>(*cursor); };
+
+			while (std::isspace(peek())) { ++cursor; }
+
+			const auto* token_begin = cursor;
+			if (std::isalpha(peek()))
+			{
+				do {
+					++cursor;
+				} while (std::isalnum(peek()));
+
+				identifier_str = std::string_view{token_begin, static_cast<std::size_t>(cursor - token_begin)};
+
+				if (identifier_str == "def") { return tokenizer::tok_def; }
+				if (identifier_str == "extern") { return tokenizer::tok_extern; }
+				if (identifier_str == "if") { return tokenizer::tok_if; }
+				if (identifier_str == "then") { return tokenizer::tok_then; }
+				if (identifier_str == "else") { return tokenizer::tok_else; }
+				if (identifier_str == "for") { return tokenizer::tok_for; }
+				if (identifier_str == "in") { return tokenizer::tok_in; }
+				if (identifier_str == "binary") { return tokenizer::tok_binary; }
+				if (identifier_str == "unary") { return tokenizer::tok_unary; }
+
+				static_cast<void>(symbols.intern(identifier_str));
+				return tokenizer::tok_identifier;
+			}
+
+			if (std::isdigit(peek()) || peek() == '.')
+			{
+				do {
+					++cursor;
+				} while (std::isdigit(peek()) || peek() == '.');
+
+				const std::string num_str{token_begin, cursor};
+				num_val = std::strtod(num_str.c_str(), nullptr);
+				return tokenizer::tok_number;
+			}
+
+			if (peek() == EOF) { return tokenizer::tok_eof; }
+
+			return *cursor++;
+		}
+
+		/// identifier_heavy_input - Roughly `bytes` of definitions dominated by
+		/// identifiers, a few of which are keywords or keyword prefixes.
+		std::string identifier_heavy_input(const std::size_t bytes)
+		{
+			std::string input;
+			input.reserve(bytes + 128);
+
+			for (std::size_t i = 0; input.size() < bytes; ++i)
+			{
+				const auto n = std::to_string(i);
+				input += "def accumulate" + n + "(alpha beta gamma delta)\n";
+				input += "  if alpha < beta then inner" + n + "(alpha, gamma) else definitely(delta, unaryish, forward) ";
+				input += "+ for idx = alpha, idx < beta, step in binaryop(idx, extern" + n + ");\n";
+			}
+
+			return input;
+		}
+	}// namespace
+
+	void lexer_benchmark()
+	{
+		const auto input  = identifier_heavy_input(16 * 1024 * 1024);
+		constexpr auto repeat = 5;
+
+		std::size_t reference_tokens = 0;
+		const auto	reference_time	 = best_of(repeat, [&] {
+			  symbol_table	   symbols;
+			  const auto*	   cursor = input.data();
+			  std::string_view identifier_str;
+			  double		   num_val;
+
+			  reference_tokens = 0;
+			  while (reference_get_token(symbols, cursor, input.data() + input.size(), identifier_str, num_val) != tokenizer::tok_eof) { ++reference_tokens; }
+		  });
+
+		std::size_t tokens		= 0;
+		const auto	table_time = best_of(repeat, [&] {
+			 symbol_table symbols;
+			 tokenizer	  tok{symbols, std::make_unique<view_source>(input)};
+
+			 tokens = 0;
+			 while (tok.get_token() != tokenizer::tok_eof) { ++tokens; }
+		 });
+
+		if (tokens != reference_tokens)
+		{
+			std::cerr << "token count mismatch: " << tokens << " vs " << reference_tokens << '\n';
+			std::exit(1);
+		}
+
+		const auto report = [&](const char* name, const double seconds) {
+			std::cout << std::setw(24) << std::left << name
+					  << std::setw(10) << std::right << std::fixed << std::setprecision(1) << static_cast<double>(input.size()) / seconds / (1024 * 1024) << " MiB/s"
+					  << std::setw(10) << static_cast<double>(tokens) / seconds / 1e6 << " Mtok/s\n";
+		};
+
+		std::cout << input.size() / 1024 << " KiB, " << tokens << " tokens, best of " << repeat << '\n';
+		report("cctype + compare chain", reference_time);
+		report("class table + hash", table_time);
+		std::cout << "speedup: " << std::setprecision(2) << reference_time / table_time << "x\n";
+	}
+}// namespace hello_llvm::benchmark
@@ -0,0 +1,39 @@
+#include "benchmark.hpp"
+
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+	struct entry
+	{
+		const char* name;
+		void (*run)();
+	};
+
+	constexpr entry benchmarks[]{
+			{"lexer", hello_llvm::benchmark::lexer_benchmark},
+			{"batch", hello_llvm::benchmark::batch_benchmark},
+			{"jit_memory", hello_llvm::benchmark::jit_memory_benchmark},
+			{"compile_threads", hello_llvm::benchmark::compile_threads_benchmark},
+			{"pipeline", hello_llvm::benchmark::pipeline_benchmark},
+	};
+}// namespace
+
+/// kaleidoscope_benchmark [name...] - Run the named benchmarks, or all of them.
+int main(int argc, char* argv[])
+{
+	for (const auto& [name, run]: benchmarks)
+	{
+		auto selected = argc == 1;
+		for (auto i = 1; i < argc; ++i) { selected |= std::strcmp(argv[i], name) == 0; }
+
+		if (selected)
+		{
+			std::cout << "== " << name << '\n';
+			run();
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include "benchmark.hpp"
+
+#include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/Support/TargetSelect.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace hello_llvm::benchmark
+{
+	namespace
+	{
+		/// script - A long generated script, as --pipeline streams: definitions with
+		/// branches and loops, each followed by an expression calling it.
+		std::string script(const int definitions)
+		{
+			std::string source = "extern sin(x);\n";
+			for (auto i = 0; i < definitions; ++i)
+			{
+				const auto n = std::to_string(i);
+				source += "def f" + n + "(x y) if x < " + std::to_string(i % 13) + " then sin(x) * y + " + n +
+						  " else (for i = 0, i < y in x * i + sin(i)) + x * " + n + ";\n";
+				source += "f" + n + "(" + std::to_string(i % 17) + ", " + std::to_string(i % 5) + ") * 0.5 + 1;\n";
+			}
+			return source;
+		}
+
+		/// stage_times - Seconds spent by either side of the queue between the parsing
+		/// thread and the compile threads.
+		struct stage_times
+		{
+			double front_end;
+			double back_end;
+		};
+
+		/// run_stages - Parse, fold and code generate the script, as the parsing thread
+		/// does, each item into a module of its own handed to the JIT. Then optimize
+		/// and compile them all, as the compile threads do, by looking the expressions
+		/// up. The expressions are compiled but not run.
+		stage_times run_stages(const std::string& source)
+		{
+			std::vector<std::string> expressions;
+			session s;
+			s.dump_ir			   = false;
+			s.results			   = nullptr;
+			s.deferred_expressions = &expressions;
+
+			stage_times times{};
+			times.front_end = best_of(1, [&] {
+				parser p{s, std::make_unique<string_source>(source)};
+				p.run_all([](const top_level_item&) { return true; });
+			});
+
+			times.back_end = best_of(1, [&] {
+				for (const auto& name: expressions) { s.exit_on_error(s.jit->lookup(name)); }
+			});
+			return times;
+		}
+	}// namespace
+
+	void pipeline_benchmark()
+	{
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+
+		constexpr auto definitions = 1000;
+		constexpr auto repeat = 3;
+		const auto source = script(definitions);
+
+		stage_times best{std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+		for (auto i = 0; i < repeat; ++i)
+		{
+			const auto times = run_stages(source);
+			best.front_end = std::min(best.front_end, times.front_end);
+			best.back_end = std::min(best.back_end, times.back_end);
+		}
+
+		const auto report = [&](const char* name, const double seconds) {
+			std::cout << std::setw(28) << std::left << name
+					  << std::setw(10) << std::right << std::fixed << std::setprecision(1) << seconds * 1e3 << " ms"
+					  << std::setw(8) << std::setprecision(1) << 100 * seconds / (best.front_end + best.back_end) << " %\n";
+		};
+
+		std::cout << 2 * definitions << " items, each stage best of " << repeat << '\n';
+		report("parse, fold and codegen", best.front_end);
+		report("optimize and compile", best.back_end);
+	}
+}// namespace hello_llvm::benchmark
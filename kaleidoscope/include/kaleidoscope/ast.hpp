@@ -1,11 +1,21 @@
 #ifndef HELLO_LLVM_AST_HPP
 #define HELLO_LLVM_AST_HPP
 
+#include <kaleidoscope/symbol_table.hpp>
+
+#include <llvm-12/llvm/ADT/DenseMap.h>
+#include <llvm-12/llvm/ADT/DenseSet.h>
+#include <llvm-12/llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm-12/llvm/ADT/STLExtras.h>
 #include <llvm-12/llvm/IR/IRBuilder.h>
 #include <llvm-12/llvm/Support/Error.h>
 
-#include <map>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
@@ -20,74 +30,171 @@ namespace llvm
 	class Value;
 	class Function;
 
-	namespace legacy
-	{
-		class FunctionPassManager;
-	}
-
 	namespace orc
 	{
 		class KaleidoscopeJIT;
+		class KaleidoscopeAOT;
+		class ResourceTracker;
 	}
 }
 
 namespace hello_llvm
 {
-	class expr_ast;
-	class number_expr_ast;
-	class variable_expr_ast;
-	class binary_expr_ast;
-	class call_expr_ast;
+	class expr_pool;
 	class prototype_ast;
 	class function_ast;
+	struct pure_function;
+	class expression_cache;
+	class expression_pipeline;
+
+	/// expr_index - Position of a node in its expr_pool, 32 bits are plenty even for
+	/// very large generated functions and halve the size of a child link.
+	using expr_index = std::uint32_t;
+
+	/// null_expr - Returned by the parser on errors, and used for a missing for step.
+	constexpr expr_index null_expr = std::numeric_limits<expr_index>::max();
 
 	////===----------------------------------------------------------------------===//
 	//// Top-Level parsing and JIT Driver
 	////===----------------------------------------------------------------------===//
-	struct global_context
+
+	/// session - Everything one stream of items is parsed and compiled with: the
+	/// symbols, the module being filled, the JIT and what is defined in it. Separate
+	/// sessions may run on separate threads at the same time, including the ones
+	/// forked from the same session, which share nothing but its JIT.
+	struct session
 	{
 		llvm::ExitOnError exit_on_error;
 
+		symbol_table symbols;
+
 		std::unique_ptr<llvm::LLVMContext> context;
 		std::unique_ptr<llvm::Module> module;
 		std::unique_ptr<llvm::IRBuilder<>> builder;
-		std::unique_ptr<llvm::legacy::FunctionPassManager> fpm;
-		std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
-
-		std::map<std::string, std::unique_ptr<prototype_ast>> functions_proto;
-		std::map<std::string, llvm::Value*> named_values;
-
-		/// bin_op_precedence - This holds the precedence for each binary operator that is defined.
-		std::map<char, int> bin_op_precedence_;
-
-		static global_context& get();
+		std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit;
+		/// aot - If set, also receives every module of definitions handed to the JIT, to
+		/// emit them ahead of time at the end.
+		std::unique_ptr<llvm::orc::KaleidoscopeAOT> aot;
+
+		/// tracker - What the definitions handed to the JIT are tracked by, to remove
+		/// them together later, the JIT's default tracker if null.
+		llvm::IntrusiveRefCntPtr<llvm::orc::ResourceTracker> tracker;
+
+		/// expressions - The compiled top-level expressions, reused when one comes again.
+		/// Destroyed before the JIT, which it frees them from.
+		std::unique_ptr<expression_cache> expressions;
+
+		llvm::DenseMap<symbol_id, std::unique_ptr<prototype_ast>> functions_proto;
+
+		/// defined_functions - Functions with a body, in the current module or the JIT,
+		/// which the JIT would reject a second one for.
+		llvm::DenseSet<symbol_id> defined_functions;
+
+		/// function_versions - Bumped whenever a name gets a new prototype, so that what
+		/// was compiled against the previous one can tell it is stale.
+		llvm::DenseMap<symbol_id, std::uint32_t> function_versions;
+
+		/// pure_functions - Bodies of the defined functions without side effects, which
+		/// the constant folder may evaluate at compile time.
+		llvm::DenseMap<symbol_id, std::unique_ptr<pure_function>> pure_functions;
+		llvm::DenseMap<symbol_id, llvm::Value*> named_values;
+
+		/// module_functions - Functions already declared in the current module, so that
+		/// callee resolution does not go through the module's by-name symbol table.
+		llvm::DenseMap<symbol_id, llvm::Function*> module_functions;
+
+		/// batch_definitions - Accumulate definitions in the current module instead of
+		/// handing each one to the JIT on its own, see flush_definitions.
+		bool batch_definitions{false};
+		/// pending_definitions - Definitions in the current module not yet handed to the JIT.
+		std::size_t pending_definitions{0};
+
+		/// interpret_expressions - Evaluate cheap top-level expressions with the
+		/// interpreter instead of compiling them.
+		bool interpret_expressions{true};
+
+		/// pipeline - If set, top-level expressions are handed to it to run on its own
+		/// thread, in order, while the parser goes on. They are all compiled then, as
+		/// neither the interpreter nor the expression cache is for more than one thread.
+		expression_pipeline* pipeline{nullptr};
+
+		/// deferred_expressions - If set, top-level expressions are neither run nor
+		/// compiled but code generated into the current module, with the definitions,
+		/// under names of their own appended here, for whoever adds the module to the
+		/// JIT to run them.
+		std::vector<std::string>* deferred_expressions{nullptr};
+
+		/// dump_ir - Print the IR of every item as it is read, for interactive use.
+		bool dump_ir{true};
+		/// results - Where the values of top-level expressions go, std::cerr by default,
+		/// nowhere if null.
+		std::ostream* results;
+
+		/// bin_op_precedence - This holds the precedence for each binary operator that is defined,
+		/// indexed by the (ascii) operator character, 0 if it is not a binary operator.
+		std::array<int, 128> bin_op_precedence_{};
+
+		session();
+		~session();
+
+		session(const session& other) = delete;
+		session& operator=(const session& other) = delete;
+
+		/// fork - A new session compiling into the same JIT, which starts out knowing the
+		/// functions and operators defined so far, and with the same settings. Flushes
+		/// the pending definitions first, for the fork to be able to call them.
+		[[nodiscard]] std::unique_ptr<session> fork();
+
+		/// print_result - Show the value of a top-level expression in results.
+		void print_result(double value) const;
+
+		/// print_failure - Show, in place of its value, that a top-level expression failed
+		/// to run. Why is reported on stderr.
+		void print_failure() const;
 
 		/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-		[[nodiscard]] static int get_token_precedence(int tok);
+		[[nodiscard]] int get_token_precedence(int tok) const;
 
-		static auto add_bin_op_precedence(char op, int precedence)
+		void add_bin_op_precedence(const char op, const int precedence)
 		{
-			return get().bin_op_precedence_.emplace(op, precedence);
+			bin_op_precedence_[static_cast<unsigned char>(op)] = precedence;
 		}
 
-		static auto erase_bin_op(char op)
+		void erase_bin_op(const char op)
 		{
-			return get().bin_op_precedence_.erase(op);
+			bin_op_precedence_[static_cast<unsigned char>(op)] = 0;
 		}
 
-		[[nodiscard]] static std::pair<std::unique_ptr<llvm::Module>, std::unique_ptr<llvm::LLVMContext>> refresh();
+		[[nodiscard]] std::pair<std::unique_ptr<llvm::Module>, std::unique_ptr<llvm::LLVMContext>> refresh();
+
+		/// add_definition - Record a definition code generated into the current module,
+		/// flushing it right away unless batch_definitions is set.
+		void add_definition();
+
+		/// flush_definitions - Hand the pending definitions to the JIT as one module. Runs
+		/// before anything needs them compiled: a top-level expression, end of input, or
+		/// an explicit call.
+		void flush_definitions();
 
-		[[nodiscard]] static llvm::Function*															  get_function(const std::string& name);
+		/// discard_definitions - Drop the pending definitions instead, after an error.
+		void discard_definitions();
 
-		static std::pair<decltype(functions_proto)::iterator, bool>						  insert_or_assign_function(std::unique_ptr<prototype_ast> ast);
+		[[nodiscard]] llvm::Function* get_function(symbol_id name);
+
+		prototype_ast& insert_or_assign_function(std::unique_ptr<prototype_ast> ast);
+
+		/// remove_function - Forget the function `name`, whose code is about to be
+		/// removed from the JIT, and free its batch kernel and the cached expressions
+		/// calling it. It may be defined again afterwards.
+		void remove_function(symbol_id name);
 
 	private:
-		global_context();
+		session(std::shared_ptr<llvm::orc::KaleidoscopeJIT> shared_jit, const symbol_table& known_symbols);
 
 		void new_module_and_context();
 	};
 
-	std::unique_ptr<expr_ast> log_error(const char* str);
+	expr_index log_error(const char* str);
 	std::unique_ptr<prototype_ast> log_error_p(const char* str);
 	llvm::Value* log_error_v(const char* str);
 
@@ -95,135 +202,132 @@ namespace hello_llvm
 	// Abstract Syntax Tree (aka Parse Tree) and Code Generation
 	//===----------------------------------------------------------------------===//
 
-	/// expr_ast - Base class for all expression nodes.
-	class expr_ast
+	/// expr_kind - Tag byte of an expr_node.
+	enum class expr_kind : std::uint8_t
 	{
-	public:
-		virtual ~expr_ast();
-
-		expr_ast() = default;
-		expr_ast(const expr_ast& other) = default;
-		expr_ast(expr_ast&& other) noexcept = default;
-		expr_ast& operator=(const expr_ast& other) = default;
-		expr_ast& operator=(expr_ast&& other) noexcept = default;
-
-		virtual llvm::Value* codegen() = 0;
+		number,
+		variable,
+		unary,
+		binary,
+		call,
+		if_then_else,
+		for_in,
 	};
 
-	/// number_expr_ast - Expression class for numeric literals like "1.0".
-	class number_expr_ast final : public expr_ast
+	/// expr_node - One expression, what operands holds depends on kind:
+	///   number        the bits of the double literal
+	///   variable      [0] name
+	///   unary         op, [0] operand
+	///   binary        op, [0] lhs, [1] rhs
+	///   call          [0] callee name, [1] extra -> argc, args...
+	///   if_then_else  [0] cond, [1] extra -> then, else
+	///   for_in        [0] variable name, [1] extra -> init, end, step, body
+	/// Names are symbol_ids, extra indexes expr_pool::extra_.
+	struct expr_node
 	{
-		double val_;
-
-	public:
-		explicit number_expr_ast(const double val)
-			: val_(val) {}
-
-		llvm::Value* codegen() override;
-	};
-
-	/// variable_expr_ast - Expression class for referencing a variable, like "a".
-	class variable_expr_ast final : public expr_ast
-	{
-		std::string name_;
-
-	public:
-		explicit variable_expr_ast(std::string name)
-			: name_(std::move(name)) {}
-
-		llvm::Value* codegen() override;
+		expr_kind kind;
+		char op;
+		std::array<std::uint32_t, 2> operands;
 	};
 
-	#if __clang__
-		#pragma clang	diagnostic push
-		#pragma clang diagnostic ignored "-Wpadded"
-	#endif
+	static_assert(sizeof(expr_node) == 12, "keep expr_node packed");
 
-	/// unary_expr_ast - Expression class for a unary operator.
-	class unary_expr_ast final : public expr_ast
+	/// expr_pool - Contiguous storage for the expressions of one top-level item, the
+	/// nodes refer to each other by index. It is reset once the item has been code
+	/// generated, keeping its capacity for the next one, so that it is the per-item
+	/// arena too: once the parser's pool has grown to fit, the nodes of an item cost
+	/// no allocation at all. Being indexes, unlike arena pointers, they survive the
+	/// pool being copied, as pure_function bodies are.
+	class expr_pool
 	{
-		// padding 7 bytes :(
-		char op_;
-		std::unique_ptr<expr_ast> operand_;
+		std::vector<expr_node> nodes_;
+		std::vector<expr_index> extra_;
 
-	public:
-		unary_expr_ast(const char op, std::unique_ptr<expr_ast> operand)
-			: op_(op),
-			  operand_(std::move(operand)) {}
+		expr_index add(expr_kind kind, char op, std::uint32_t first, std::uint32_t second);
 
-		llvm::Value* codegen() override;
-	};
-
-	/// binary_expr_ast - Expression class for a binary operator.
-	class binary_expr_ast final : public expr_ast
-	{
-		// padding 7 bytes :(
-		char op_;
-		std::unique_ptr<expr_ast> lhs_;
-		std::unique_ptr<expr_ast> rhs_;
+		llvm::Value* codegen_variable(session& s, const expr_node& node) const;
+		llvm::Value* codegen_unary(session& s, const expr_node& node) const;
+		llvm::Value* codegen_binary(session& s, const expr_node& node) const;
+		llvm::Value* codegen_call(session& s, const expr_node& node) const;
+		llvm::Value* codegen_if(session& s, const expr_node& node) const;
+		llvm::Value* codegen_for(session& s, const expr_node& node) const;
 
 	public:
-		binary_expr_ast(const char op, std::unique_ptr<expr_ast> lhs, std::unique_ptr<expr_ast> rhs)
-			: op_(op),
-			  lhs_(std::move(lhs)),
-			  rhs_(std::move(rhs)) {}
+		struct if_parts
+		{
+			expr_index cond;
+			expr_index then;
+			expr_index else_;
+		};
 
-		llvm::Value* codegen() override;
-	};
+		struct for_parts
+		{
+			symbol_id var_name;
+			expr_index init;
+			expr_index end;
+			expr_index step;
+			expr_index body;
+		};
+
+		expr_index add_number(double val);
+		expr_index add_variable(symbol_id name);
+		expr_index add_unary(char op, expr_index operand);
+		expr_index add_binary(char op, expr_index lhs, expr_index rhs);
+		expr_index add_call(symbol_id callee, std::span<const expr_index> args);
+		expr_index add_if(expr_index cond, expr_index then, expr_index else_);
+		expr_index add_for(symbol_id var_name, expr_index init, expr_index end, expr_index step, expr_index body);
+
+		[[nodiscard]] const expr_node& operator[](const expr_index index) const noexcept { return nodes_[index]; }
+		[[nodiscard]] std::size_t size() const noexcept { return nodes_.size(); }
+
+		[[nodiscard]] static double number(const expr_node& node) noexcept
+		{
+			double val;
+			std::memcpy(&val, node.operands.data(), sizeof(val));
+			return val;
+		}
 
-	#ifdef __clang__
-		#pragma clang diagnostic pop
-	#endif
+		/// name - The variable name or callee of a variable or call node.
+		[[nodiscard]] static symbol_id name(const expr_node& node) noexcept { return node.operands[0]; }
 
-	/// call_expr_ast - Expression class for function calls.
-	class call_expr_ast final : public expr_ast
-	{
-		std::string callee_;
-		std::vector<std::unique_ptr<expr_ast>> args_;
+		[[nodiscard]] std::span<const expr_index> call_args(const expr_node& node) const noexcept
+		{
+			const auto* extra = extra_.data() + node.operands[1];
+			return {extra + 1, extra[0]};
+		}
 
-	public:
-		call_expr_ast(std::string callee,
-		              std::vector<std::unique_ptr<expr_ast>> args)
-			: callee_(std::move(callee)),
-			  args_(std::move(args)) {}
+		[[nodiscard]] if_parts if_operands(const expr_node& node) const noexcept
+		{
+			return {node.operands[0], extra_[node.operands[1]], extra_[node.operands[1] + 1]};
+		}
 
-		llvm::Value* codegen() override;
-	};
+		[[nodiscard]] for_parts for_operands(const expr_node& node) const noexcept
+		{
+			const auto* extra = extra_.data() + node.operands[1];
+			return {node.operands[0], extra[0], extra[1], extra[2], extra[3]};
+		}
 
-	/// if_expr_ast - Expression class for if/then/else.
-	class if_expr_ast final : public expr_ast
-	{
-		std::unique_ptr<expr_ast> cond_;
-		std::unique_ptr<expr_ast> then_;
-		std::unique_ptr<expr_ast> else_;
+		/// set_number/replace - Rewrite a node in place, for the constant folder. Whatever
+		/// the node referred to before is left unreachable.
+		void set_number(expr_index index, double val);
+		void replace(const expr_index index, const expr_index with) noexcept { nodes_[index] = nodes_[with]; }
 
-	public:
-		if_expr_ast(std::unique_ptr<expr_ast> cond, std::unique_ptr<expr_ast> then, std::unique_ptr<expr_ast> else_)
-			: cond_(std::move(cond)),
-			  then_(std::move(then)),
-			  else_(std::move(else_)) {}
+		/// rename_symbols - Replace every name the nodes hold by rename(name), to move
+		/// them over to another session's symbol table.
+		void rename_symbols(llvm::function_ref<symbol_id(symbol_id)> rename);
+
+		/// codegen - Walk the pool from `index` down, switching on the tag of each node.
+		llvm::Value* codegen(session& s, expr_index index) const;
 
-		llvm::Value* codegen() override;
+		/// reset - Drop every node at once.
+		void reset();
 	};
 
-	/// ForExprAST - Expression class for for/in.
-	class for_expr_ast final : public expr_ast
+	/// pure_function - A copy of the pool holding a pure function's body.
+	struct pure_function
 	{
-		std::string cond_name_;
-		std::unique_ptr<expr_ast> init_;
-		std::unique_ptr<expr_ast> end_;
-		std::unique_ptr<expr_ast> step_;
-		std::unique_ptr<expr_ast> body_;
-
-	public:
-		for_expr_ast(std::string cond_var, std::unique_ptr<expr_ast> init, std::unique_ptr<expr_ast> end, std::unique_ptr<expr_ast> step, std::unique_ptr<expr_ast> body)
-			: cond_name_(std::move(cond_var)),
-			  init_(std::move(init)),
-			  end_(std::move(end)),
-			  step_(std::move(step)),
-			  body_(std::move(body)) {}
-
-		llvm::Value* codegen() override;
+		expr_pool pool;
+		expr_index body;
 	};
 
 	/// prototype_ast - This class represents the "prototype" for a function,
@@ -231,45 +335,55 @@ namespace hello_llvm
 	/// of arguments the function takes), as well as if it is an operator.
 	class prototype_ast
 	{
-		std::string name_;
-		std::vector<std::string> args_;
+		symbol_id name_;
+		std::vector<symbol_id> args_;
 
 		bool					 is_operator_;
 		int						 precedence_; // Precedence if a binary op.
 
 	public:
-		prototype_ast(std::string name, std::vector<std::string> args,
+		prototype_ast(symbol_id name, std::vector<symbol_id> args,
 			bool is_operator = false, int precendence = 0)
-			: name_(std::move(name)),
+			: name_(name),
 			  args_(std::move(args)),
 			  is_operator_(is_operator),
 			  precedence_(precendence) {}
 
-		llvm::Function* codegen();
+		llvm::Function* codegen(session& s);
+
+		[[nodiscard]] symbol_id get_name() const noexcept { return name_; }
 
-		[[nodiscard]] const std::string& get_name() const noexcept { return name_; }
+		[[nodiscard]] const std::vector<symbol_id>& get_args() const noexcept { return args_; }
 
 		[[nodiscard]] bool				 is_unary() const noexcept { return is_operator_ && args_.size() == 1; }
 		[[nodiscard]] bool				 is_binary() const noexcept { return is_operator_ && args_.size() == 2; }
 
-		[[nodiscard]] char				 get_operator_name() const noexcept { return name_.back(); }
+		[[nodiscard]] char				 get_operator_name(const symbol_table& symbols) const noexcept { return symbols.name(name_).back(); }
 
 		[[nodiscard]] int get_precedence() const noexcept { return precedence_; }
 	};
 
 	/// function_ast - This class represents a function definition itself.
+	/// The body lives in the parser's expr_pool, the prototype outlives it.
 	class function_ast
 	{
 		std::unique_ptr<prototype_ast> proto_;
-		std::unique_ptr<expr_ast> body_;
+		const expr_pool* pool_;
+		expr_index body_;
 
 	public:
 		function_ast(std::unique_ptr<prototype_ast> proto,
-		             std::unique_ptr<expr_ast> body)
+		             const expr_pool& pool,
+		             expr_index body)
 			: proto_(std::move(proto)),
-			  body_(std::move(body)) {}
+			  pool_(&pool),
+			  body_(body) {}
+
+		/// get_proto - Only until codegen, which hands the prototype over to the session.
+		[[nodiscard]] const prototype_ast& get_proto() const noexcept { return *proto_; }
+		[[nodiscard]] expr_index get_body() const noexcept { return body_; }
 
-		llvm::Function* codegen();
+		llvm::Function* codegen(session& s);
 	};
 }// namespace hello_llvm
 
@@ -0,0 +1,53 @@
+#ifndef HELLO_LLVM_BATCH_HPP
+#define HELLO_LLVM_BATCH_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Batch evaluation
+	//===----------------------------------------------------------------------===//
+
+	/// batch_kernel - A function applied to whole arrays at once. The JIT compiles a
+	/// loop over the rows with the function inlined into it, which vectorizes the
+	/// way a call per row never does. Its inputs are one array per parameter
+	/// (structure of arrays), natively:
+	///   void f.batch(const double* a, const double* b, ..., double* out, size_t n)
+	class batch_kernel
+	{
+		std::uintptr_t address_;
+		std::size_t arity_;
+
+		batch_kernel(const std::uintptr_t address, const std::size_t arity)
+			: address_(address),
+			  arity_(arity) {}
+
+	public:
+		/// max_arguments - Functions with more parameters have no batch kernel.
+		constexpr static std::size_t max_arguments = 8;
+
+		/// compile - The kernel of the function `name` of session `s`, compiled on first
+		/// use, or nullopt (after reporting why) if there is no such function, it has
+		/// no body, or the kernel fails to compile.
+		[[nodiscard]] static std::optional<batch_kernel> compile(session& s, std::string_view name);
+
+		[[nodiscard]] std::size_t arity() const noexcept { return arity_; }
+
+		/// address - Of the native kernel, to call it with the signature above.
+		[[nodiscard]] std::uintptr_t address() const noexcept { return address_; }
+
+		/// operator() - out[i] = f(columns[0][i], ..., columns[arity - 1][i]) for every
+		/// i < n. Returns false (after reporting why), with out untouched, unless there
+		/// is one column per parameter.
+		bool operator()(std::span<const double* const> columns, double* out, std::size_t n) const;
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_BATCH_HPP
@@ -0,0 +1,68 @@
+#ifndef HELLO_LLVM_BOUNDED_QUEUE_HPP
+#define HELLO_LLVM_BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace hello_llvm
+{
+	/// bounded_queue - Hands items from one thread to another in order. Pushing
+	/// blocks while `capacity` items are waiting, so that the producer cannot run
+	/// arbitrarily far ahead of the consumer.
+	template<typename T>
+	class bounded_queue
+	{
+		std::mutex mutex_;
+		std::condition_variable not_empty_;
+		std::condition_variable not_full_;
+		std::deque<T> items_;
+		std::size_t capacity_;
+		bool closed_{false};
+
+	public:
+		explicit bounded_queue(const std::size_t capacity)
+			: capacity_(capacity) {}
+
+		void push(T item)
+		{
+			{
+				std::unique_lock lock{mutex_};
+				not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+				items_.push_back(std::move(item));
+			}
+			not_empty_.notify_one();
+		}
+
+		/// pop - The oldest item, nullopt once the queue is closed and drained.
+		[[nodiscard]] std::optional<T> pop()
+		{
+			std::optional<T> item;
+			{
+				std::unique_lock lock{mutex_};
+				not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+				if (items_.empty()) { return item; }
+
+				item.emplace(std::move(items_.front()));
+				items_.pop_front();
+			}
+			not_full_.notify_one();
+			return item;
+		}
+
+		/// close - Nothing more is pushed, pop returns what is left and then nullopt.
+		void close()
+		{
+			{
+				std::lock_guard lock{mutex_};
+				closed_ = true;
+			}
+			not_empty_.notify_all();
+		}
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_BOUNDED_QUEUE_HPP
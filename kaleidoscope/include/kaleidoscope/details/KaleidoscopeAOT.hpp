@@ -0,0 +1,220 @@
+//===- KaleidoscopeAOT.h - Ahead of time compiler for Kaleidoscope -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Collects the modules handed to the JIT into one program and emits it as a
+// native object file or shared library, with a C header declaring its
+// functions, so that other programs link them without any JIT.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEAOT_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEAOT_H
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/ADT/SmallString.h>
+#include <llvm-12/llvm/Bitcode/BitcodeReader.h>
+#include <llvm-12/llvm/Bitcode/BitcodeWriter.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm-12/llvm/IR/LLVMContext.h>
+#include <llvm-12/llvm/IR/LegacyPassManager.h>
+#include <llvm-12/llvm/IR/Module.h>
+#include <llvm-12/llvm/Linker/Linker.h>
+#include <llvm-12/llvm/Support/FileSystem.h>
+#include <llvm-12/llvm/Support/FileUtilities.h>
+#include <llvm-12/llvm/Support/Path.h>
+#include <llvm-12/llvm/Support/Program.h>
+#include <llvm-12/llvm/Support/raw_ostream.h>
+#include <llvm-12/llvm/Target/TargetMachine.h>
+#include <cctype>
+#include <memory>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class KaleidoscopeAOT {
+  std::unique_ptr<TargetMachine> TM;
+  unsigned OptLevel;
+
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> Program;
+  bool Optimized = false;
+
+  KaleidoscopeAOT(std::unique_ptr<TargetMachine> TM, unsigned OptLevel)
+      : TM(std::move(TM)), OptLevel(OptLevel),
+        Context(std::make_unique<LLVMContext>()),
+        Program(std::make_unique<Module>("kaleidoscope", *Context)) {
+    Program->setTargetTriple(this->TM->getTargetTriple().str());
+    Program->setDataLayout(this->TM->createDataLayout());
+  }
+
+  /// Functions are optimized as a whole program, once everything is in.
+  void optimize() {
+    if (Optimized)
+      return;
+    KaleidoscopeJIT::runPipeline(*Program, *TM, OptLevel);
+    Optimized = true;
+  }
+
+  /// Whether Name can be spelled in C, operators such as "binary|" cannot.
+  static bool isCIdentifier(StringRef Name) {
+    if (Name.empty() || std::isdigit(static_cast<unsigned char>(Name[0])))
+      return false;
+    for (char C : Name)
+      if (!std::isalnum(static_cast<unsigned char>(C)) && C != '_')
+        return false;
+    return true;
+  }
+
+  static void printDeclaration(raw_ostream &OS, const Function &F) {
+    OS << "double " << F.getName() << "(";
+    if (F.arg_empty())
+      OS << "void";
+    for (unsigned I = 0, E = F.arg_size(); I != E; ++I)
+      OS << (I ? ", double" : "double");
+    OS << ");\n";
+  }
+
+  /// Close the file written to Path, reporting a write that failed, a full
+  /// disk for one, which raw_fd_ostream only remembers.
+  static Error closeOutput(raw_fd_ostream &OS, StringRef Path) {
+    OS.close();
+    if (!OS.has_error())
+      return Error::success();
+
+    auto EC = OS.error();
+    OS.clear_error();
+    return createStringError(EC, "cannot write '%s'", Path.str().c_str());
+  }
+
+public:
+  /// Compile for the target JTMB describes, at -O<OptLevel>. The code is
+  /// position independent so that it also fits in a shared library.
+  static Expected<std::unique_ptr<KaleidoscopeAOT>>
+  Create(JITTargetMachineBuilder JTMB, unsigned OptLevel) {
+    JTMB.setRelocationModel(Reloc::PIC_);
+
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    return std::unique_ptr<KaleidoscopeAOT>(
+        new KaleidoscopeAOT(std::move(*TM), OptLevel));
+  }
+
+  /// Add a copy of the definitions in M to the program, M is left as is for
+  /// the JIT.
+  Error addModule(const Module &M) {
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+
+    auto Copy = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                        M.getModuleIdentifier()),
+        *Context);
+    if (!Copy)
+      return Copy.takeError();
+
+    if (Linker::linkModules(*Program, std::move(*Copy)))
+      return createStringError(inconvertibleErrorCode(),
+                               "cannot link '%s' into the program",
+                               M.getModuleIdentifier().c_str());
+    Optimized = false;
+    return Error::success();
+  }
+
+  /// Write the program as a relocatable object file.
+  Error emitObject(StringRef Path) {
+    optimize();
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC)
+      return createStringError(EC, "cannot open '%s'", Path.str().c_str());
+
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile))
+      return createStringError(inconvertibleErrorCode(),
+                               "the target cannot emit object files");
+    PM.run(*Program);
+    return closeOutput(OS, Path);
+  }
+
+  /// Write the program as a shared library, linked by the system's C
+  /// compiler driver. The functions it calls without defining them, such as
+  /// putchard, are left for the program loading it to provide.
+  Error emitSharedLibrary(StringRef Path) {
+    SmallString<128> Object;
+    if (auto EC = sys::fs::createTemporaryFile("kaleidoscope", "o", Object))
+      return createStringError(EC, "cannot create a temporary object file");
+    FileRemover RemoveObject(Object);
+
+    if (auto Err = emitObject(Object))
+      return Err;
+
+    auto Driver = sys::findProgramByName("cc");
+    if (!Driver)
+      return createStringError(Driver.getError(),
+                               "cannot find 'cc' to link '%s'",
+                               Path.str().c_str());
+
+    StringRef Args[] = {*Driver, "-shared", "-o", Path, Object};
+    std::string Message;
+    if (sys::ExecuteAndWait(*Driver, Args, None, {}, 0, 0, &Message) != 0)
+      return createStringError(inconvertibleErrorCode(),
+                               "linking '%s' failed%s%s", Path.str().c_str(),
+                               Message.empty() ? "" : ": ", Message.c_str());
+    return Error::success();
+  }
+
+  /// Write a C header declaring the functions the program defines, and
+  /// those it expects from whatever it is linked with.
+  Error emitHeader(StringRef Path) {
+    optimize();
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+    if (EC)
+      return createStringError(EC, "cannot open '%s'", Path.str().c_str());
+
+    std::string Guard = "KALEIDOSCOPE_";
+    for (char C : sys::path::filename(Path))
+      Guard += std::isalnum(static_cast<unsigned char>(C))
+                   ? static_cast<char>(std::toupper(static_cast<unsigned char>(C)))
+                   : '_';
+
+    OS << "/* Generated by kaleidoscope, do not edit. */\n\n"
+       << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+       << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+
+    OS << "/* Defined. */\n";
+    for (auto &F : *Program)
+      if (!F.isDeclaration() && isCIdentifier(F.getName()))
+        printDeclaration(OS, F);
+
+    bool Imports = false;
+    for (auto &F : *Program) {
+      if (!F.isDeclaration() || F.isIntrinsic() || !isCIdentifier(F.getName()))
+        continue;
+      if (!Imports)
+        OS << "\n/* To be provided. */\n";
+      Imports = true;
+      printDeclaration(OS, F);
+    }
+
+    OS << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+    return closeOutput(OS, Path);
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEAOT_H
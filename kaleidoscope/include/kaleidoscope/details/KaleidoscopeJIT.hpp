@@ -17,46 +17,726 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include <kaleidoscope/details/KaleidoscopeMemoryManager.hpp>
+#include <kaleidoscope/details/KaleidoscopeObjectCache.hpp>
+
+#include <llvm-12/llvm/ADT/STLExtras.h>
+#include <llvm-12/llvm/ADT/StringMap.h>
+#include <llvm-12/llvm/ADT/StringSet.h>
 #include <llvm-12/llvm/ADT/StringRef.h>
+#include <llvm-12/llvm/Bitcode/BitcodeReader.h>
+#include <llvm-12/llvm/Bitcode/BitcodeWriter.h>
 #include <llvm-12/llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/CompileUtils.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/Core.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/ExecutionUtils.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/IRTransformLayer.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/TPCIndirectionUtils.h>
 #include <llvm-12/llvm/ExecutionEngine/Orc/TargetProcessControl.h>
 #include <llvm-12/llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm-12/llvm/IR/DataLayout.h>
+#include <llvm-12/llvm/IR/Dominators.h>
+#include <llvm-12/llvm/IR/IRBuilder.h>
 #include <llvm-12/llvm/IR/LLVMContext.h>
+#include <llvm-12/llvm/Linker/Linker.h>
+#include <llvm-12/llvm/Passes/PassBuilder.h>
+#include <llvm-12/llvm/Support/ThreadPool.h>
+#include <llvm-12/llvm/Support/Threading.h>
+#include <llvm-12/llvm/Support/raw_ostream.h>
+#include <llvm-12/llvm/Target/TargetMachine.h>
+#include <llvm-12/llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// Like ConcurrentIRCompiler, but creates the TargetMachine from a builder the
+/// JIT owns, so the target can still be tuned after the JIT is constructed.
+class TunableIRCompiler : public IRCompileLayer::IRCompiler {
+  const JITTargetMachineBuilder &JTMB;
+  KaleidoscopeObjectCache *ObjCache;
+  Optional<CodeGenOpt::Level> ForcedOptLevel;
+
+public:
+  TunableIRCompiler(const JITTargetMachineBuilder &JTMB,
+                    KaleidoscopeObjectCache *ObjCache = nullptr,
+                    Optional<CodeGenOpt::Level> ForcedOptLevel = None)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(JTMB), ObjCache(ObjCache), ForcedOptLevel(ForcedOptLevel) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    auto Builder = JTMB;
+    if (ForcedOptLevel)
+      Builder.setCodeGenOptLevel(*ForcedOptLevel);
+
+    auto TM = Builder.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    SimpleCompiler C(**TM, ObjCache);
+    auto Obj = C(M);
+    // The object never reaches the cache then, and the key it was looked up
+    // under must not be left for another module allocated at the same address.
+    if (!Obj && ObjCache)
+      ObjCache->forgetObject(&M);
+    return Obj;
+  }
+};
+
+/// Every module is optimized (by OptimizeLayer) with the standard new pass
+/// manager pipeline of the selected level, O2 unless told otherwise.
+///
+/// Small functions are kept around as bitcode when their module is added, and
+/// imported as available_externally definitions into the modules that call
+/// them, so that the inliner sees through calls to earlier modules (user
+/// defined operators in particular).
+///
+/// Eager mode compiles each module as a whole the first time any of its symbols
+/// is looked up. Lazy mode goes through a CompileOnDemandLayer instead: every
+/// function is reached via an indirect stub, and is only extracted, optimized
+/// and compiled the first time it is called.
+///
+/// With compile threads, materialization is dispatched to a thread pool, and
+/// eagerly added modules start compiling in the background as soon as they are
+/// added. Every module owns its ThreadSafeContext, so they compile in parallel.
+///
+/// Tiered mode compiles each function quickly and unoptimized first, with a
+/// call counter at its entry, and callers reach it through an indirect stub.
+/// A function that becomes hot is optimized and compiled again on a background
+/// thread, and its stub is then pointed at the new code.
+///
+/// Objects are loaded into memory pooled across all of them (see
+/// KaleidoscopeMemoryPool), so that the code of a short-lived top-level
+/// expression is recycled for the next one rather than unmapped.
+///
+/// A batch kernel applies one function over arrays, a loop with the function's
+/// body inlined into it, so that it gets vectorized.
+///
+/// With step limits, the loop iterations and calls of the optimized code count
+/// against a budget of the thread running it, and it returns 0 once that is
+/// spent, which cuts runaway code short.
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<TargetProcessControl> TPC;
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<TPCIndirectionUtils> TPCIU;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  /// Target settings for both compile layers, fixed once modules are added.
+  JITTargetMachineBuilder JTMB;
+  unsigned OptLevel = 2;
+
+  /// Set by the first module added, see checkNoModulesAdded.
+  std::atomic<bool> ModulesAdded{false};
+
+  KaleidoscopeObjectCache ObjCache;
+
+  /// Where the objects are loaded, unless PooledMemory is turned off. Outlives
+  /// the ObjectLayer, which gives the memory back as objects are removed.
+  KaleidoscopeMemoryPool MemoryPool;
+  bool PooledMemory = true;
+
   RTDyldObjectLinkingLayer ObjectLayer;
+  IRCompileLayer BaselineCompileLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+  CompileOnDemandLayer CODLayer;
 
   JITDylib &MainJD;
 
+  bool Lazy = false;
+
+  std::unique_ptr<ThreadPool> CompileThreads;
+
+  /// Background lookups started by addModule and not finished yet.
+  std::mutex OutstandingMutex;
+  std::condition_variable OutstandingDone;
+  size_t Outstanding = 0;
+
+  /// Calls after which a tiered function is re-optimized, 0 if not tiered.
+  uint64_t TierUpThreshold = 0;
+  std::unique_ptr<IndirectStubsManager> TierStubs;
+  std::unique_ptr<ThreadPool> TierUpThread;
+
+  /// Whether the modules added count steps, see setStepLimits.
+  bool StepLimits = false;
+
+  /// The steps left to the code running on this thread, and whether it ran
+  /// out of them, see limitThreadSteps.
+  static inline thread_local uint64_t ThreadStepsLeft =
+      std::numeric_limits<uint64_t>::max();
+  static inline thread_local bool ThreadStepsExhausted = false;
+
+  /// Loop iterations counted down inline before they are charged at once.
+  static constexpr uint64_t StepBatch = 1024;
+
+  /// The pristine IR of each tiered function, until it is re-optimized, and
+  /// the tracker its tier 0 code was added under, which tier 1 goes under too.
+  struct TieredFunction {
+    std::string Name;
+    ThreadSafeModule Module;
+    ResourceTrackerSP RT;
+  };
+  std::mutex TieredMutex;
+  std::vector<TieredFunction> Tiered;
+
+  /// Functions of at most this many instructions are offered for inlining
+  /// into later modules, 0 disables cross-module inlining.
+  unsigned MaxInlineSize = 32;
+
+  /// The bodies of the functions, by name: the bitcode of the module each one
+  /// was added with, written once for all of them, and the function's size.
+  /// Only the small ones are read back for other modules, a larger one only
+  /// once a batch kernel is compiled for it. A module's bitcode is freed with
+  /// the last of its functions dropped.
+  struct InlineBody {
+    std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+    unsigned Size;
+  };
+  std::mutex InlineBodiesMutex;
+  StringMap<InlineBody> InlineBodies;
+
+  /// The batch kernels compiled so far, by name, each with a tracker of its
+  /// own to remove it with its function.
+  std::mutex BatchKernelsMutex;
+  StringMap<ResourceTrackerSP> BatchKernels;
+
+  /// Fail the change of Setting, which the modules added so far were
+  /// compiled (or are being compiled) without.
+  Error checkNoModulesAdded(const char *Setting) const {
+    if (ModulesAdded)
+      return createStringError(inconvertibleErrorCode(),
+                               "%s cannot change once modules are added",
+                               Setting);
+    return Error::success();
+  }
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    std::exit(1);
+  }
+
+  static PassBuilder::OptimizationLevel passBuilderLevel(unsigned Level) {
+    switch (Level) {
+    case 0:
+      return PassBuilder::OptimizationLevel::O0;
+    case 1:
+      return PassBuilder::OptimizationLevel::O1;
+    case 2:
+      return PassBuilder::OptimizationLevel::O2;
+    default:
+      return PassBuilder::OptimizationLevel::O3;
+    }
+  }
+
+  static CodeGenOpt::Level codeGenLevel(unsigned Level) {
+    switch (Level) {
+    case 0:
+      return CodeGenOpt::None;
+    case 1:
+      return CodeGenOpt::Less;
+    case 2:
+      return CodeGenOpt::Default;
+    default:
+      return CodeGenOpt::Aggressive;
+    }
+  }
+
+  Expected<ThreadSafeModule>
+  optimizeModule(ThreadSafeModule TSM, const MaterializationResponsibility &) {
+    // The vectorizers and the unroller size their work through the target's
+    // TargetTransformInfo, so the pipeline needs the real TargetMachine.
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    TSM.withModuleDo([&](Module &M) {
+      if (OptLevel != 0)
+        importInlineBodies(M);
+
+      runPipeline(M, **TM, OptLevel);
+      if (StepLimits)
+        addStepChecks(M);
+    });
+
+    return Expected<ThreadSafeModule>(std::move(TSM));
+  }
+
+  /// Link the bodies of the small functions M calls into it, and of those they
+  /// call in turn, as available_externally: the optimizer may inline them, and
+  /// drops whatever is left of them afterwards rather than emitting a second
+  /// definition. The body of Always is imported whatever its size.
+  ///
+  /// The modules they come from are loaded lazily, and only the bodies wanted
+  /// are read from them.
+  void importInlineBodies(Module &M, StringRef Always = StringRef()) {
+    StringSet<> Imported;
+    while (true) {
+      // The names to import from each module, in the order first needed.
+      std::vector<std::pair<std::shared_ptr<const SmallVector<char, 0>>,
+                            StringSet<>>>
+          Imports;
+      {
+        std::lock_guard<std::mutex> Lock(InlineBodiesMutex);
+        for (auto &F : M) {
+          if (!F.isDeclaration() || F.isIntrinsic())
+            continue;
+
+          auto I = InlineBodies.find(F.getName());
+          if (I == InlineBodies.end() ||
+              (I->second.Size > MaxInlineSize && F.getName() != Always) ||
+              !Imported.insert(F.getName()).second)
+            continue;
+
+          auto Source = llvm::find_if(Imports, [&](const auto &Import) {
+            return Import.first == I->second.Bitcode;
+          });
+          if (Source == Imports.end())
+            Source = Imports.insert(Imports.end(), {I->second.Bitcode, {}});
+          Source->second.insert(F.getName());
+        }
+      }
+
+      if (Imports.empty())
+        return;
+
+      for (auto &[Bitcode, Names] : Imports) {
+        auto Body = getLazyBitcodeModule(
+            MemoryBufferRef(StringRef(Bitcode->data(), Bitcode->size()),
+                            M.getModuleIdentifier()),
+            M.getContext());
+        if (!Body) {
+          consumeError(Body.takeError());
+          continue;
+        }
+
+        // The rest of the module is never read, not even the bodies of its
+        // other functions that M declares.
+        for (auto &F : **Body) {
+          if (F.isDeclaration())
+            continue;
+          if (Names.count(F.getName()))
+            F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+          else
+            F.deleteBody();
+        }
+
+        // Importing is only an optimization, never fail the module over it.
+        Linker::linkModules(M, std::move(*Body), Linker::Flags::LinkOnlyNeeded);
+      }
+    }
+  }
+
+  /// Keep the IR of M's functions for importInlineBodies. Done as the module
+  /// is added: eager modules are only optimized once looked up, which may well
+  /// be after the modules calling into them. The module is written once for
+  /// all of them, the body of a function is only read back if imported.
+  void exportInlineBodies(Module &M) {
+    if (MaxInlineSize == 0)
+      return;
+
+    std::vector<std::pair<StringRef, unsigned>> Bodies;
+    for (auto &F : M)
+      if (!F.isDeclaration())
+        Bodies.emplace_back(F.getName(), F.getInstructionCount());
+    if (Bodies.empty())
+      return;
+
+    auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+    raw_svector_ostream OS(*Bitcode);
+    WriteBitcodeToFile(M, OS);
+
+    std::lock_guard<std::mutex> Lock(InlineBodiesMutex);
+    for (auto &[Name, Size] : Bodies)
+      InlineBodies[Name] = {Bitcode, Size};
+  }
+
+  /// Build, optimize and add the kernel KernelName, which applies the function
+  /// Name of NumArgs doubles over arrays, tracked by RT.
+  Error addBatchKernel(StringRef Name, StringRef KernelName, unsigned NumArgs,
+                       ResourceTrackerSP RT) {
+    ModulesAdded = true;
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = std::make_unique<Module>(KernelName, *Ctx);
+    M->setDataLayout(DL);
+    M->setTargetTriple(JTMB.getTargetTriple().str());
+
+    auto *DoubleTy = Type::getDoubleTy(*Ctx);
+    auto *DoublePtrTy = DoubleTy->getPointerTo();
+    auto *SizeTy = DL.getIntPtrType(*Ctx);
+
+    SmallVector<Type *, 8> CalleeParams(NumArgs, DoubleTy);
+    auto *Callee = Function::Create(
+        FunctionType::get(DoubleTy, CalleeParams, false),
+        Function::ExternalLinkage, Name, *M);
+
+    SmallVector<Type *, 8> Params(NumArgs + 1, DoublePtrTy);
+    Params.push_back(SizeTy);
+    auto *Kernel = Function::Create(
+        FunctionType::get(Type::getVoidTy(*Ctx), Params, false),
+        Function::ExternalLinkage, KernelName, *M);
+
+    // The columns and the output are separate arrays, so the vectorized loop
+    // needs no runtime checks for overlap.
+    for (unsigned Arg = 0; Arg <= NumArgs; ++Arg) {
+      Kernel->addParamAttr(Arg, Attribute::NoAlias);
+      Kernel->addParamAttr(Arg, Attribute::NoCapture);
+      if (Arg != NumArgs)
+        Kernel->addParamAttr(Arg, Attribute::ReadOnly);
+    }
+
+    auto *Entry = BasicBlock::Create(*Ctx, "entry", Kernel);
+    auto *Loop = BasicBlock::Create(*Ctx, "loop", Kernel);
+    auto *Exit = BasicBlock::Create(*Ctx, "exit", Kernel);
+    auto *N = Kernel->getArg(NumArgs + 1);
+
+    IRBuilder<> B(Entry);
+    B.CreateCondBr(B.CreateICmpEQ(N, ConstantInt::get(SizeTy, 0)), Exit, Loop);
+
+    B.SetInsertPoint(Loop);
+    auto *I = B.CreatePHI(SizeTy, 2, "i");
+    I->addIncoming(ConstantInt::get(SizeTy, 0), Entry);
+    SmallVector<Value *, 8> Args;
+    for (unsigned Arg = 0; Arg != NumArgs; ++Arg)
+      Args.push_back(B.CreateLoad(
+          DoubleTy, B.CreateInBoundsGEP(DoubleTy, Kernel->getArg(Arg), I)));
+    B.CreateStore(B.CreateCall(Callee, Args),
+                  B.CreateInBoundsGEP(DoubleTy, Kernel->getArg(NumArgs), I));
+    auto *Next = B.CreateNUWAdd(I, ConstantInt::get(SizeTy, 1), "next");
+    I->addIncoming(Next, Loop);
+    B.CreateCondBr(B.CreateICmpEQ(Next, N), Exit, Loop);
+
+    B.SetInsertPoint(Exit);
+    B.CreateRetVoid();
+
+    // The whole point of the kernel is a loop without calls, whatever the size
+    // of the function. Unless cross-module inlining is disabled altogether.
+    importInlineBodies(*M, Name);
+    if (auto *F = M->getFunction(Name); F && !F->isDeclaration())
+      F->addFnAttr(Attribute::AlwaysInline);
+
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    runPipeline(*M, **TM, std::max(OptLevel, 2u));
+    if (StepLimits)
+      addStepChecks(*M);
+
+    return CompileLayer.add(std::move(RT),
+                            ThreadSafeModule(std::move(M), std::move(Ctx)));
+  }
+
+  /// Called from tier 0 code the moment a function reaches TierUpThreshold.
+  static void tierUpEntry(KaleidoscopeJIT *JIT, uint64_t Index) {
+    JIT->TierUpThread->async([JIT, Index] { JIT->tierUp(Index); });
+  }
+
+  /// Count the calls to F, from any thread, and request its tier up on the
+  /// threshold-th one.
+  void addCallCounter(Function &F, uint64_t Index) {
+    auto &M = *F.getParent();
+    auto &Ctx = M.getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+
+    auto *Calls = new GlobalVariable(M, Int64Ty, false,
+                                     GlobalValue::InternalLinkage,
+                                     ConstantInt::get(Int64Ty, 0),
+                                     F.getName() + ".calls");
+    auto TierUp = M.getOrInsertFunction("__kaleidoscope_tier_up",
+                                        Type::getVoidTy(Ctx), Int8PtrTy,
+                                        Int64Ty);
+
+    auto *Body = &F.getEntryBlock();
+    auto *Count = BasicBlock::Create(Ctx, "count", &F, Body);
+    auto *Hot = BasicBlock::Create(Ctx, "tier_up", &F, Body);
+
+    IRBuilder<> Builder(Count);
+    auto *One = ConstantInt::get(Int64Ty, 1);
+    auto *N = Builder.CreateAdd(
+        Builder.CreateAtomicRMW(AtomicRMWInst::Add, Calls, One,
+                                AtomicOrdering::Monotonic),
+        One);
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(N, ConstantInt::get(Int64Ty, TierUpThreshold)),
+        Hot, Body);
+
+    // Tier 0 code is never cached, so the JIT can simply be baked in.
+    Builder.SetInsertPoint(Hot);
+    Builder.CreateCall(
+        TierUp, {ConstantExpr::getIntToPtr(
+                     ConstantInt::get(Int64Ty, pointerToJITTargetAddress(this)),
+                     Int8PtrTy),
+                 ConstantInt::get(Int64Ty, Index)});
+    Builder.CreateBr(Body);
+  }
+
+  /// Called from step limited code to charge Steps to the thread running it:
+  /// whether it may go on.
+  static uint8_t stepEntry(uint64_t Steps) {
+    if (ThreadStepsLeft < Steps) {
+      ThreadStepsLeft = 0;
+      ThreadStepsExhausted = true;
+      return 0;
+    }
+    ThreadStepsLeft -= Steps;
+    return 1;
+  }
+
+  /// Make the functions of M count their steps, and return 0 right away once
+  /// the thread running them is out of them. Whatever they return to is cut
+  /// short the same way at its next step. Only done to code about to be
+  /// compiled, so that neither the optimizer nor the inline bodies see it.
+  ///
+  /// A loop iteration is counted down inline, in a register of the call, and
+  /// charged to the thread StepBatch at a time. Recursion has nothing to count
+  /// down in, so a function that makes calls charges each of its own calls.
+  void addStepChecks(Module &M) {
+    auto &Ctx = M.getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto Step = M.getOrInsertFunction("__kaleidoscope_step",
+                                      Type::getInt8Ty(Ctx), Int64Ty);
+
+    for (auto &F : M) {
+      if (F.isDeclaration())
+        continue;
+
+      // A back edge leads to a block that dominates the one it leaves.
+      DominatorTree DT(F);
+      SmallVector<std::pair<Instruction *, unsigned>, 4> BackEdges;
+      bool MakesCalls = false;
+      for (auto &BB : F) {
+        for (auto &I : BB)
+          if (auto *Call = dyn_cast<CallBase>(&I))
+            MakesCalls |= !Call->getCalledFunction() ||
+                          !Call->getCalledFunction()->isIntrinsic();
+
+        auto *Term = BB.getTerminator();
+        for (unsigned I = 0; I != Term->getNumSuccessors(); ++I)
+          if (DT.dominates(Term->getSuccessor(I), &BB))
+            BackEdges.push_back({Term, I});
+      }
+      if (BackEdges.empty() && !MakesCalls)
+        continue;
+
+      auto *Exhausted = BasicBlock::Create(Ctx, "steps_exhausted", &F);
+      ReturnInst::Create(Ctx,
+                         F.getReturnType()->isVoidTy()
+                             ? nullptr
+                             : Constant::getNullValue(F.getReturnType()),
+                         Exhausted);
+
+      // Charge Steps at the end of Check, and go on to Next if they were left.
+      auto Charge = [&](BasicBlock *Check, uint64_t Steps, BasicBlock *Next) {
+        IRBuilder<> Builder(Check);
+        auto *Left = Builder.CreateCall(Step, {Builder.getInt64(Steps)});
+        Builder.CreateCondBr(Builder.CreateICmpNE(Left, Builder.getInt8(0)),
+                             Next, Exhausted);
+      };
+
+      auto &Entry = F.getEntryBlock();
+      AllocaInst *Batch = nullptr;
+      if (!BackEdges.empty()) {
+        Batch = new AllocaInst(Int64Ty, 0, "steps", &*Entry.begin());
+        new StoreInst(ConstantInt::get(Int64Ty, StepBatch), Batch,
+                      Entry.getTerminator());
+      }
+
+      for (auto [Term, I] : BackEdges) {
+        auto *From = Term->getParent();
+        auto *To = Term->getSuccessor(I);
+        auto *Count = BasicBlock::Create(Ctx, "step", &F, To);
+        auto *Refill = BasicBlock::Create(Ctx, "steps_charge", &F, To);
+        Term->setSuccessor(I, Count);
+        for (auto &Phi : To->phis()) {
+          auto Index = Phi.getBasicBlockIndex(From);
+          Phi.setIncomingBlock(Index, Count);
+          Phi.addIncoming(Phi.getIncomingValue(Index), Refill);
+        }
+
+        IRBuilder<> Builder(Count);
+        auto *Left = Builder.CreateSub(Builder.CreateLoad(Int64Ty, Batch),
+                                       Builder.getInt64(1));
+        Builder.CreateStore(Left, Batch);
+        Builder.CreateCondBr(Builder.CreateICmpEQ(Left, Builder.getInt64(0)),
+                             Refill, To);
+
+        Builder.SetInsertPoint(Refill);
+        Builder.CreateStore(Builder.getInt64(StepBatch), Batch);
+        Charge(Refill, StepBatch, To);
+      }
+
+      if (MakesCalls) {
+        // After the allocas, which must stay in the entry block.
+        auto Body = Entry.begin();
+        while (isa<AllocaInst>(*Body))
+          ++Body;
+        auto *Rest = Entry.splitBasicBlock(Body, "body");
+        Entry.getTerminator()->eraseFromParent();
+        Charge(&Entry, 1, Rest);
+      }
+
+      if (Batch) {
+        DominatorTree Updated(F);
+        PromoteMemToReg({Batch}, Updated);
+      }
+    }
+  }
+
+  /// Optimize and compile tiered function Index, and switch its stub over.
+  void tierUp(uint64_t Index) {
+    std::string Name;
+    ThreadSafeModule TSM;
+    ResourceTrackerSP RT;
+    {
+      std::lock_guard<std::mutex> Lock(TieredMutex);
+      Name = Tiered[Index].Name;
+      TSM = std::move(Tiered[Index].Module);
+      RT = std::move(Tiered[Index].RT);
+    }
+    // Already tiered up, or removed since.
+    if (!TSM || RT->isDefunct())
+      return;
+
+    // Under the tier 0 code's tracker, so that both are removed together and
+    // the function can then be defined, and tiered up, again.
+    if (auto Err = OptimizeLayer.add(std::move(RT), std::move(TSM))) {
+      ES->reportError(std::move(Err));
+      return;
+    }
+
+    auto Sym = lookup(Name + ".tier1");
+    if (!Sym) {
+      ES->reportError(Sym.takeError());
+      return;
+    }
+
+    if (auto Err = TierStubs->updatePointer(Name, Sym->getAddress()))
+      ES->reportError(std::move(Err));
+  }
+
+  /// Add the tier 0 bodies of TSM's functions behind stubs, appending their
+  /// names to AllNames for compileTier0, which points the stubs at them.
+  Error addTieredModule(ThreadSafeModule TSM, ResourceTrackerSP RT,
+                        std::vector<std::string> &AllNames) {
+    std::vector<std::string> Names;
+    TSM.withModuleDo([&](Module &M) {
+      for (auto &F : M)
+        if (!F.isDeclaration())
+          Names.push_back(F.getName().str());
+    });
+
+    // Set the pristine IR aside for tier 1 before instrumenting it.
+    std::vector<uint64_t> Indices;
+    for (auto &Name : Names) {
+      auto Clone = cloneToNewContext(
+          TSM, [&](const GlobalValue &GV) { return GV.getName() == Name; });
+      Clone.withModuleDo(
+          [&](Module &M) { M.getFunction(Name)->setName(Name + ".tier1"); });
+
+      std::lock_guard<std::mutex> Lock(TieredMutex);
+      Indices.push_back(Tiered.size());
+      Tiered.push_back({Name, std::move(Clone), RT});
+    }
+
+    // The stubs take the functions' names, so that every caller, including a
+    // recursive tier 0 body, goes through them.
+    SymbolMap Stubs;
+    for (auto &Name : Names) {
+      if (auto Err = TierStubs->createStub(
+              Name, 0, JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+        return Err;
+      Stubs[Mangle(Name)] = TierStubs->findStub(Name, false);
+    }
+    if (auto Err =
+            RT->getJITDylib().define(absoluteSymbols(std::move(Stubs)), RT))
+      return Err;
+
+    TSM.withModuleDo([&](Module &M) {
+      for (size_t I = 0; I != Names.size(); ++I) {
+        auto *F = M.getFunction(Names[I]);
+        F->setName(Names[I] + ".tier0");
+        F->replaceAllUsesWith(Function::Create(F->getFunctionType(),
+                                               Function::ExternalLinkage,
+                                               Names[I], M));
+        addCallCounter(*F, Indices[I]);
+      }
+      if (StepLimits)
+        addStepChecks(M);
+    });
+
+    if (auto Err = BaselineCompileLayer.add(RT, std::move(TSM)))
+      return Err;
+
+    AllNames.insert(AllNames.end(), Names.begin(), Names.end());
+    return Error::success();
+  }
+
+  /// Compile the tier 0 bodies of Names right away, and point their stubs at
+  /// them. Only once the modules they call into are added too.
+  Error compileTier0(ArrayRef<std::string> Names) {
+    if (Names.empty())
+      return Error::success();
+
+    SymbolLookupSet Tier0;
+    for (auto &Name : Names)
+      Tier0.add(Mangle(Name + ".tier0"));
+
+    auto Tier0Syms = ES->lookup(makeJITDylibSearchOrder(&MainJD), Tier0);
+    if (!Tier0Syms)
+      return Tier0Syms.takeError();
+
+    for (auto &Name : Names)
+      if (auto Err = TierStubs->updatePointer(
+              Name, (*Tier0Syms)[Mangle(Name + ".tier0")].getAddress()))
+        return Err;
+
+    return Error::success();
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<TargetProcessControl> TPC,
                   std::unique_ptr<ExecutionSession> ES,
+                  std::unique_ptr<TPCIndirectionUtils> TPCIU,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
-      : TPC(std::move(TPC)), ES(std::move(ES)), DL(std::move(DL)),
-        Mangle(*this->ES, this->DL),
+      : TPC(std::move(TPC)), ES(std::move(ES)), TPCIU(std::move(TPCIU)),
+        DL(std::move(DL)), Mangle(*this->ES, this->DL), JTMB(std::move(JTMB)),
+        ObjCache(describeTarget()),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    [this]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                      if (PooledMemory)
+                        return std::make_unique<PooledMemoryManager>(MemoryPool);
+                      return std::make_unique<SectionMemoryManager>();
+                    }),
+        BaselineCompileLayer(*this->ES, ObjectLayer,
+                             std::make_unique<TunableIRCompiler>(
+                                 this->JTMB, nullptr, CodeGenOpt::None)),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<TunableIRCompiler>(this->JTMB,
+                                                         &ObjCache)),
+        OptimizeLayer(*this->ES, CompileLayer,
+                      [this](ThreadSafeModule TSM,
+                             const MaterializationResponsibility &R) {
+                        return optimizeModule(std::move(TSM), R);
+                      }),
+        CODLayer(*this->ES, OptimizeLayer,
+                 this->TPCIU->getLazyCallThroughManager(),
+                 [this] { return this->TPCIU->createIndirectStubsManager(); }),
         MainJD(this->ES->createBareJITDylib("<main>")) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
@@ -64,8 +744,15 @@ public:
   }
 
   ~KaleidoscopeJIT() {
+    waitForCompiles();
+    if (TierUpThread)
+      TierUpThread->wait();
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (auto Err = TPCIU->cleanup())
+      ES->reportError(std::move(Err));
   }
 
   static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
@@ -76,29 +763,386 @@ public:
 
     auto ES = std::make_unique<ExecutionSession>(std::move(SSP));
 
-    JITTargetMachineBuilder JTMB((*TPC)->getTargetTriple());
+    auto TPCIU = TPCIndirectionUtils::Create(**TPC);
+    if (!TPCIU)
+      return TPCIU.takeError();
+
+    (*TPCIU)->createLazyCallThroughManager(
+        *ES, pointerToJITTargetAddress(&handleLazyCallThroughError));
+
+    if (auto Err = setUpInProcessLCTMReentryViaTPCIU(**TPCIU))
+      return Expected<std::unique_ptr<KaleidoscopeJIT>>(std::move(Err));
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    // Generate code for the host CPU and every feature it has, rather than for
+    // the generic baseline of the triple.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
     return std::make_unique<KaleidoscopeJIT>(std::move(*TPC), std::move(ES),
-                                             std::move(JTMB), std::move(*DL));
+                                             std::move(*TPCIU),
+                                             std::move(*JTMB), std::move(*DL));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// Run the -O<Level> pipeline, tuned for TM, over M.
+  static void runPipeline(Module &M, TargetMachine &TM, unsigned Level) {
+    PipelineTuningOptions PTO;
+    PTO.LoopVectorization = Level >= 2;
+    PTO.SLPVectorization = Level >= 2;
+    PassBuilder PB(false, &TM, PTO);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    auto PBLevel = passBuilderLevel(Level);
+    auto MPM = Level == 0 ? PB.buildO0DefaultPipeline(PBLevel)
+                          : PB.buildPerModuleDefaultPipeline(PBLevel);
+    MPM.run(M, MAM);
+  }
+
+  /// The target and code generation options set up so far.
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return JTMB;
+  }
+
+  /// Disabled until given a directory, see KaleidoscopeObjectCache.
+  KaleidoscopeObjectCache &getObjectCache() { return ObjCache; }
+
+  /// Where objects are loaded, see KaleidoscopeMemoryPool.
+  KaleidoscopeMemoryPool &getMemoryPool() { return MemoryPool; }
+
+  /// Give every object memory of its own instead, as SectionMemoryManager does.
+  /// Only affects the objects loaded afterwards.
+  void setPooledMemory(bool Enable) { PooledMemory = Enable; }
+
+  /// Offer functions of up to MaxInstructions instructions for inlining into
+  /// the modules added later, 0 disables cross-module inlining.
+  void setMaxInlineSize(unsigned MaxInstructions) {
+    MaxInlineSize = MaxInstructions;
+  }
+
+  /// Optimize at -O<Level> (0 to 3), both the IR pipeline and the code
+  /// generator. Fails once any module is added.
+  Error setOptLevel(unsigned Level) {
+    if (auto Err = checkNoModulesAdded("the optimization level"))
+      return Err;
+
+    OptLevel = std::min(Level, 3u);
+    JTMB.setCodeGenOptLevel(codeGenLevel(OptLevel));
+    ObjCache.setTarget(describeTarget());
+    return Error::success();
+  }
+  unsigned getOptLevel() const { return OptLevel; }
+
+  /// Generate code for CPU (as in -mcpu) instead of the host, with only the
+  /// features CPU implies. Fails once any module is added.
+  Error setCPU(StringRef CPU) {
+    if (auto Err = checkNoModulesAdded("the target CPU"))
+      return Err;
+
+    JTMB.setCPU(CPU.str());
+    JTMB.setFeatures("");
+    ObjCache.setTarget(describeTarget());
+    return Error::success();
+  }
+  const std::string &getCPU() const { return JTMB.getCPU(); }
+
+  /// Enable or disable target features on top of the CPU's, given like -mattr
+  /// as a comma separated list such as "+avx2,-fma". Fails once any module is
+  /// added.
+  Error addFeatures(StringRef Features) {
+    if (auto Err = checkNoModulesAdded("the target features"))
+      return Err;
+
+    SmallVector<StringRef, 8> List;
+    Features.split(List, ',', -1, false);
+    for (auto Feature : List)
+      JTMB.getFeatures().AddFeature(Feature);
+    ObjCache.setTarget(describeTarget());
+    return Error::success();
+  }
+  std::string getFeatures() const { return JTMB.getFeatures().getString(); }
+
+  /// Generate code for Model, the target's default if None. Fails once any
+  /// module is added.
+  Error setCodeModel(Optional<CodeModel::Model> Model) {
+    if (auto Err = checkNoModulesAdded("the code model"))
+      return Err;
+
+    JTMB.setCodeModel(Model);
+    ObjCache.setTarget(describeTarget());
+    return Error::success();
+  }
+  const Optional<CodeModel::Model> &getCodeModel() const {
+    return JTMB.getCodeModel();
+  }
+
+  /// Everything about the target that changes the generated code.
+  std::string describeTarget() const {
+    std::string Desc;
+    raw_string_ostream OS(Desc);
+    OS << JTMB.getTargetTriple().str() << " cpu=" << JTMB.getCPU()
+       << " features=" << JTMB.getFeatures().getString() << " code-model=";
+    if (auto Model = JTMB.getCodeModel())
+      OS << static_cast<int>(*Model);
+    else
+      OS << "default";
+    OS << " -O" << OptLevel;
+    return OS.str();
+  }
+
+  /// Select the mode for modules added from now on, modules already added keep
+  /// the mode they were added with.
+  void setLazy(bool Enable) { Lazy = Enable; }
+  bool isLazy() const { return Lazy; }
+
+  /// Compile the functions of modules added from now on in two tiers,
+  /// re-optimizing those called Calls times. Not combined with lazy mode.
+  Error setTierUpThreshold(uint64_t Calls) {
+    if (Calls == 0)
+      return Error::success();
+
+    bool First = TierUpThreshold == 0;
+    TierUpThreshold = Calls;
+    if (!First)
+      return Error::success();
+
+    TierStubs = TPCIU->createIndirectStubsManager();
+    TierUpThread = std::make_unique<ThreadPool>(hardware_concurrency(1));
+
+    return MainJD.define(absoluteSymbols(
+        {{Mangle("__kaleidoscope_tier_up"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&tierUpEntry),
+                             JITSymbolFlags::Exported |
+                                 JITSymbolFlags::Callable)}}));
+  }
+  bool isTiered() const { return TierUpThreshold != 0; }
+
+  /// Count the loop iterations and calls of the modules added from now on
+  /// against the budget of the thread running them, which is unlimited until
+  /// limitThreadSteps (see addStepChecks). Fails once any module is added.
+  Error setStepLimits(bool Enable) {
+    if (auto Err = checkNoModulesAdded("the step limits"))
+      return Err;
+    if (!Enable || StepLimits)
+      return Error::success();
+
+    StepLimits = true;
+    return MainJD.define(absoluteSymbols(
+        {{Mangle("__kaleidoscope_step"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&stepEntry),
+                             JITSymbolFlags::Exported |
+                                 JITSymbolFlags::Callable)}}));
+  }
+
+  /// Give the code this thread runs from now on Steps steps, after which it
+  /// returns 0 instead of going on. Only for modules added with step limits.
+  static void limitThreadSteps(uint64_t Steps) {
+    ThreadStepsLeft = Steps;
+    ThreadStepsExhausted = false;
+  }
+
+  /// Whether code on this thread was cut short since limitThreadSteps.
+  static bool threadStepsExhausted() { return ThreadStepsExhausted; }
+
+  /// Compile on NumThreads background threads instead of on the thread that
+  /// triggers materialization. Only the first call counts, and it fails once
+  /// any module is added.
+  Error setCompileThreads(unsigned NumThreads) {
+    if (auto Err = checkNoModulesAdded("the compile threads"))
+      return Err;
+    if (NumThreads == 0 || CompileThreads)
+      return Error::success();
+
+    CompileThreads = std::make_unique<ThreadPool>(hardware_concurrency(NumThreads));
+
+    // Partitions of one module must not share its context once they can be
+    // compiled concurrently.
+    CODLayer.setCloneToNewContextOnEmit(true);
+
+    ES->setDispatchMaterialization(
+        [this](std::unique_ptr<MaterializationUnit> MU,
+               std::unique_ptr<MaterializationResponsibility> MR) {
+          // ThreadPool tasks are std::functions, which cannot hold move-only
+          // captures, so smuggle the ownership through raw pointers.
+          CompileThreads->async(
+              [UnownedMU = MU.release(), UnownedMR = MR.release()]() {
+                std::unique_ptr<MaterializationUnit> MU(UnownedMU);
+                std::unique_ptr<MaterializationResponsibility> MR(UnownedMR);
+                MU->materialize(std::move(MR));
+              });
+        });
+    return Error::success();
+  }
+
+  /// Block until every module added so far has finished compiling in the
+  /// background. Lookups wait for what they need anyway, this waits for all.
+  void waitForCompiles() {
+    std::unique_lock<std::mutex> Lock(OutstandingMutex);
+    OutstandingDone.wait(Lock, [this] { return Outstanding == 0; });
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    std::vector<ThreadSafeModule> TSMs;
+    TSMs.push_back(std::move(TSM));
+    return addModules(std::move(TSMs), std::move(RT));
+  }
+
+  /// Add modules that may call into each other as one step: the bodies of all
+  /// of them are exported before any is added, for each to inline from the
+  /// others, and the compile threads only start once every definition they
+  /// may resolve against is there.
+  Error addModules(std::vector<ThreadSafeModule> TSMs,
+                   ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    ModulesAdded = true;
+    for (auto &TSM : TSMs)
+      TSM.withModuleDo([this](Module &M) { exportInlineBodies(M); });
+
+    SymbolLookupSet Definitions;
+    std::vector<std::string> Tiered;
+    for (auto &TSM : TSMs) {
+      if (CompileThreads && !Lazy && !TierUpThreshold)
+        TSM.withModuleDo([&](Module &M) {
+          for (auto &F : M)
+            if (!F.isDeclaration())
+              Definitions.add(Mangle(F.getName()));
+        });
+
+      Error Err = Error::success();
+      if (Lazy)
+        Err = CODLayer.add(RT, std::move(TSM));
+      else if (TierUpThreshold)
+        Err = addTieredModule(std::move(TSM), RT, Tiered);
+      else
+        Err = OptimizeLayer.add(RT, std::move(TSM));
+      if (Err)
+        return Err;
+    }
+
+    if (auto Err = compileTier0(Tiered))
+      return Err;
+    compileInBackground(std::move(Definitions));
+    return Error::success();
+  }
+
+  /// Add a module that is run once and then removed through RT, such as a
+  /// top-level expression. A stub buys nothing there, and what the
+  /// CompileOnDemandLayer emits into its implementation dylib is not removed
+  /// with RT, so it is always compiled eagerly (and quickly if tiered). With
+  /// compile threads, it starts compiling in the background right away.
+  Error addTransientModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+    ModulesAdded = true;
+    // Tier 0 code is compiled as it is, without going through optimizeModule.
+    if (StepLimits && TierUpThreshold)
+      TSM.withModuleDo([this](Module &M) { addStepChecks(M); });
+
+    SymbolLookupSet Definitions;
+    if (CompileThreads)
+      TSM.withModuleDo([&](Module &M) {
+        for (auto &F : M)
+          if (!F.isDeclaration())
+            Definitions.add(Mangle(F.getName()));
+      });
+
+    auto &Layer = TierUpThreshold ? static_cast<IRLayer &>(BaselineCompileLayer)
+                                  : static_cast<IRLayer &>(OptimizeLayer);
+    if (auto Err = Layer.add(RT, std::move(TSM)))
+      return Err;
+
+    compileInBackground(std::move(Definitions));
+    return Error::success();
+  }
+
+  /// Look up Symbols without waiting for the result, which gets the compile
+  /// threads going on them.
+  void compileInBackground(SymbolLookupSet Symbols) {
+    if (Symbols.empty())
+      return;
+
+    {
+      std::lock_guard<std::mutex> Lock(OutstandingMutex);
+      ++Outstanding;
+    }
+
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+        std::move(Symbols), SymbolState::Ready,
+        [this](Expected<SymbolMap> Result) {
+          if (!Result)
+            ES->reportError(Result.takeError());
+
+          std::lock_guard<std::mutex> Lock(OutstandingMutex);
+          if (--Outstanding == 0)
+            OutstandingDone.notify_all();
+        },
+        NoDependenciesToRegister);
   }
 
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  /// Stop importing the body of Name, once its code is removed.
+  void dropInlineBody(StringRef Name) {
+    std::lock_guard<std::mutex> Lock(InlineBodiesMutex);
+    InlineBodies.erase(Name);
+  }
+
+  /// Look up the kernel applying the function Name, of NumArgs doubles, to
+  /// every row of NumArgs arrays, compiling it on first use:
+  ///   void Name.batch(const double *Arg0, ..., double *Out, size_t N)
+  /// It is optimized at -O2 at least, for the loop to be vectorized.
+  Expected<JITEvaluatedSymbol> lookupBatch(StringRef Name, unsigned NumArgs) {
+    auto KernelName = (Name + ".batch").str();
+    {
+      std::lock_guard<std::mutex> Lock(BatchKernelsMutex);
+      if (!BatchKernels.count(KernelName)) {
+        auto RT = MainJD.createResourceTracker();
+        if (auto Err = addBatchKernel(Name, KernelName, NumArgs, RT))
+          return Err;
+        BatchKernels[KernelName] = std::move(RT);
+      }
+    }
+
+    // A kernel that failed is not kept, a later definition of Name gets a new
+    // one.
+    auto Sym = lookup(KernelName);
+    if (!Sym)
+      return joinErrors(Sym.takeError(), dropBatchKernel(Name));
+    return Sym;
+  }
+
+  /// Remove the batch kernel of the function Name, if compiled, with its code.
+  /// Done when Name is removed, for a new definition to get a new kernel.
+  Error dropBatchKernel(StringRef Name) {
+    ResourceTrackerSP RT;
+    {
+      std::lock_guard<std::mutex> Lock(BatchKernelsMutex);
+      auto I = BatchKernels.find((Name + ".batch").str());
+      if (I == BatchKernels.end())
+        return Error::success();
+      RT = std::move(I->second);
+      BatchKernels.erase(I);
+    }
+    return RT->remove();
+  }
 };
 
 } // end namespace orc
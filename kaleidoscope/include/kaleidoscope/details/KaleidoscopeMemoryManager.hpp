@@ -0,0 +1,359 @@
+//===- KaleidoscopeMemoryManager.h - Pooled JIT memory ----------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A memory manager for RuntimeDyld that takes its pages from slabs shared by
+// every object of the JIT, and gives them back for reuse when the object is
+// removed, instead of mapping and unmapping memory for each one.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYMANAGER_H
+
+#include <llvm-12/llvm/ADT/SmallVector.h>
+#include <llvm-12/llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm-12/llvm/Support/Alignment.h>
+#include <llvm-12/llvm/Support/Memory.h>
+#include <llvm-12/llvm/Support/Process.h>
+#include <llvm-12/llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace llvm {
+namespace orc {
+
+/// Slabs are mapped read-write, separately for code, read-only and read-write
+/// data, so that each kind stays densely packed: the code of the functions of
+/// a long session ends up in a few contiguous executable regions. A block is
+/// handed out from the smallest free range it fits in, the lowest one of that
+/// size, and merged with its free neighbours in the same state when given back.
+///
+/// Code and read-only blocks are whole pages, as their protection changes once
+/// the object is loaded, so an object takes at least a page of each. A block
+/// taken back after that is made writable again when it is handed out the next
+/// time, which is the only system call it costs then. Read-write data keeps its
+/// protection, so its blocks are only rounded to DataGranule and the data of
+/// many small objects shares pages. Recycled blocks are zeroed, as freshly
+/// mapped pages are.
+///
+/// With huge pages, slabs are 2 MiB aligned and advised to be backed by
+/// transparent huge pages (Linux only). The kernel only keeps a huge page
+/// while the protection of all of it is the same, so this pays off for data
+/// and for code slabs once they are full.
+///
+/// It may be used from several compile threads at once.
+class KaleidoscopeMemoryPool {
+public:
+  enum Purpose { Code, ReadOnly, ReadWrite, NumPurposes };
+
+  static constexpr size_t DefaultSlabSize = 1 << 20;
+  static constexpr size_t HugePageSize = 2 << 20;
+  static constexpr size_t DataGranule = 16;
+
+private:
+  struct FreeRange {
+    size_t Size;
+    /// Its protection changed since it was mapped.
+    bool Protected;
+    /// It was handed out before, and may hold stale bytes.
+    bool Used;
+  };
+
+  size_t PageSize;
+  bool HugePages = false;
+
+  mutable std::mutex Mutex;
+  /// The slabs as mapped, unmapped with the pool.
+  std::vector<sys::MemoryBlock> Slabs;
+  /// Free ranges of each purpose by address, and by size then address.
+  std::map<uint8_t *, FreeRange> Free[NumPurposes];
+  std::set<std::pair<size_t, uint8_t *>> FreeBySize[NumPurposes];
+
+  std::atomic<uint64_t> BytesMapped{0};
+  std::atomic<uint64_t> Allocations{0};
+  std::atomic<uint64_t> Recycled{0};
+  std::atomic<uint64_t> ProtectionChanges{0};
+
+  /// Map a slab of at least Size bytes for P, and make it free.
+  Error addSlab(Purpose P, size_t Size) {
+    auto SlabSize = alignTo(std::max<size_t>(Size, DefaultSlabSize),
+                            HugePages ? HugePageSize : PageSize);
+
+    // Room to align the start on a huge page.
+    std::error_code EC;
+    auto Mapped = sys::Memory::allocateMappedMemory(
+        SlabSize + (HugePages ? HugePageSize : 0), nullptr,
+        sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+    if (EC)
+      return errorCodeToError(EC);
+
+    auto *Start = static_cast<uint8_t *>(Mapped.base());
+    if (HugePages) {
+      Start = reinterpret_cast<uint8_t *>(
+          alignTo(reinterpret_cast<uintptr_t>(Start), HugePageSize));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+      ::madvise(Start, SlabSize, MADV_HUGEPAGE);
+#endif
+    }
+
+    Slabs.push_back(Mapped);
+    BytesMapped += Mapped.allocatedSize();
+    release(P, Start, SlabSize, false, false);
+    return Error::success();
+  }
+
+  void insertRange(Purpose P, uint8_t *Start, const FreeRange &Range) {
+    Free[P][Start] = Range;
+    FreeBySize[P].insert({Range.Size, Start});
+  }
+
+  void eraseRange(Purpose P, std::map<uint8_t *, FreeRange>::iterator It) {
+    FreeBySize[P].erase({It->second.Size, It->first});
+    Free[P].erase(It);
+  }
+
+  /// Insert the range, merged with the ones right before and after it if they
+  /// are in the same state, for fresh pages not to be zeroed or made writable
+  /// again along with recycled ones.
+  void release(Purpose P, uint8_t *Start, size_t Size, bool Protected,
+               bool Used) {
+    auto &Ranges = Free[P];
+    auto SameState = [&](const FreeRange &R) {
+      return R.Protected == Protected && R.Used == Used;
+    };
+
+    auto Next = Ranges.lower_bound(Start);
+    if (Next != Ranges.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second.Size == Start && SameState(Prev->second)) {
+        Start = Prev->first;
+        Size += Prev->second.Size;
+        eraseRange(P, Prev);
+      }
+    }
+    if (Next != Ranges.end() && Start + Size == Next->first &&
+        SameState(Next->second)) {
+      Size += Next->second.Size;
+      eraseRange(P, Next);
+    }
+    insertRange(P, Start, {Size, Protected, Used});
+  }
+
+public:
+  KaleidoscopeMemoryPool() : PageSize(sys::Process::getPageSizeEstimate()) {}
+
+  ~KaleidoscopeMemoryPool() {
+    for (auto &Slab : Slabs)
+      sys::Memory::releaseMappedMemory(Slab);
+  }
+
+  KaleidoscopeMemoryPool(const KaleidoscopeMemoryPool &) = delete;
+  KaleidoscopeMemoryPool &operator=(const KaleidoscopeMemoryPool &) = delete;
+
+  /// Back the slabs mapped from now on with transparent huge pages.
+  void setHugePages(bool Enable) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    HugePages = Enable;
+  }
+  bool getHugePages() const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return HugePages;
+  }
+
+  size_t getPageSize() const { return PageSize; }
+
+  /// A writable block of at least Size bytes for P, whole pages unless P is
+  /// ReadWrite.
+  Expected<sys::MemoryBlock> allocate(Purpose P, size_t Size) {
+    Size = alignTo(std::max<size_t>(Size, 1),
+                   P == ReadWrite ? DataGranule : PageSize);
+
+    uint8_t *Start;
+    FreeRange Range;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto Fit = FreeBySize[P].lower_bound({Size, nullptr});
+      if (Fit == FreeBySize[P].end()) {
+        if (auto Err = addSlab(P, Size))
+          return Err;
+        Fit = FreeBySize[P].lower_bound({Size, nullptr});
+      }
+
+      auto It = Free[P].find(Fit->second);
+      Start = It->first;
+      Range = It->second;
+      eraseRange(P, It);
+      if (Range.Size > Size)
+        insertRange(P, Start + Size,
+                    {Range.Size - Size, Range.Protected, Range.Used});
+    }
+
+    sys::MemoryBlock Block(Start, Size);
+    if (Range.Protected) {
+      ++ProtectionChanges;
+      if (auto EC = sys::Memory::protectMappedMemory(
+              Block, sys::Memory::MF_READ | sys::Memory::MF_WRITE))
+        return errorCodeToError(EC);
+    }
+    if (Range.Used) {
+      std::memset(Start, 0, Size);
+      ++Recycled;
+    }
+
+    ++Allocations;
+    return Block;
+  }
+
+  /// Change the protection of a block handed out by allocate.
+  std::error_code protect(const sys::MemoryBlock &Block, unsigned Flags) {
+    ++ProtectionChanges;
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  /// Give a block back, Protected if protect changed it.
+  void release(Purpose P, const sys::MemoryBlock &Block, bool Protected) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    release(P, static_cast<uint8_t *>(Block.base()), Block.allocatedSize(),
+            Protected, true);
+  }
+
+  void printStats(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    OS << "jit memory: " << Slabs.size() << " slabs (" << BytesMapped / 1024
+       << " KiB), " << Allocations << " blocks, " << Recycled << " recycled, "
+       << ProtectionChanges << " protection changes\n";
+  }
+};
+
+/// The memory manager of one object: RuntimeDyld reserves what the object
+/// needs up front, so each of its kinds of sections gets one block from the
+/// pool, which the sections are carved out of. The blocks go back to the pool
+/// when the object is removed.
+class PooledMemoryManager : public RTDyldMemoryManager {
+  using Purpose = KaleidoscopeMemoryPool::Purpose;
+
+  struct Block {
+    Purpose P;
+    sys::MemoryBlock Memory;
+  };
+
+  KaleidoscopeMemoryPool &Pool;
+  SmallVector<Block, 3> Blocks;
+  /// What is left of the last block of each purpose.
+  uint8_t *Next[KaleidoscopeMemoryPool::NumPurposes] = {};
+  uint8_t *End[KaleidoscopeMemoryPool::NumPurposes] = {};
+  bool Finalized = false;
+
+  bool reserve(Purpose P, uintptr_t Size) {
+    auto Memory = Pool.allocate(P, Size);
+    if (!Memory) {
+      consumeError(Memory.takeError());
+      return false;
+    }
+
+    Blocks.push_back({P, *Memory});
+    Next[P] = static_cast<uint8_t *>(Memory->base());
+    End[P] = Next[P] + Memory->allocatedSize();
+    return true;
+  }
+
+  uint8_t *allocate(Purpose P, uintptr_t Size, unsigned Alignment) {
+    auto Align = std::max(Alignment, 16u);
+    auto Fits = [&] {
+      return Next[P] &&
+             alignAddr(Next[P], llvm::Align(Align)) + Size <=
+                 reinterpret_cast<uintptr_t>(End[P]);
+    };
+
+    // Only if RuntimeDyld reserved too little, which it should not.
+    if (!Fits() && !reserve(P, Size + Align))
+      return nullptr;
+
+    auto *Start = reinterpret_cast<uint8_t *>(
+        alignAddr(Next[P], llvm::Align(Align)));
+    Next[P] = Start + Size;
+    return Start;
+  }
+
+public:
+  explicit PooledMemoryManager(KaleidoscopeMemoryPool &Pool) : Pool(Pool) {}
+
+  ~PooledMemoryManager() override {
+    for (auto &B : Blocks)
+      Pool.release(B.P, B.Memory,
+                   Finalized && B.P != KaleidoscopeMemoryPool::ReadWrite);
+  }
+
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override {
+    if (CodeSize)
+      reserve(KaleidoscopeMemoryPool::Code, CodeSize + CodeAlign);
+    if (RODataSize)
+      reserve(KaleidoscopeMemoryPool::ReadOnly, RODataSize + RODataAlign);
+    if (RWDataSize)
+      reserve(KaleidoscopeMemoryPool::ReadWrite, RWDataSize + RWDataAlign);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned /*SectionID*/,
+                               StringRef /*SectionName*/) override {
+    return allocate(KaleidoscopeMemoryPool::Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned /*SectionID*/,
+                               StringRef /*SectionName*/,
+                               bool IsReadOnly) override {
+    return allocate(IsReadOnly ? KaleidoscopeMemoryPool::ReadOnly
+                               : KaleidoscopeMemoryPool::ReadWrite,
+                    Size, Alignment);
+  }
+
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    Finalized = true;
+    for (auto &B : Blocks) {
+      if (B.P == KaleidoscopeMemoryPool::ReadWrite)
+        continue;
+
+      auto Flags = B.P == KaleidoscopeMemoryPool::Code
+                       ? sys::Memory::MF_READ | sys::Memory::MF_EXEC
+                       : sys::Memory::MF_READ;
+      if (auto EC = Pool.protect(B.Memory, Flags)) {
+        if (ErrMsg)
+          *ErrMsg = EC.message();
+        return true;
+      }
+      if (B.P == KaleidoscopeMemoryPool::Code)
+        sys::Memory::InvalidateInstructionCache(B.Memory.base(),
+                                                B.Memory.allocatedSize());
+    }
+    return false;
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYMANAGER_H
@@ -0,0 +1,178 @@
+//===- KaleidoscopeObjectCache.h - Object cache for Kaleidoscope -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// An ObjectCache that keeps compiled objects in a local directory, so modules
+// that have not changed since the last run skip codegen entirely.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
+
+#include <llvm-12/llvm/ADT/DenseMap.h>
+#include <llvm-12/llvm/ADT/SmallString.h>
+#include <llvm-12/llvm/ADT/StringExtras.h>
+#include <llvm-12/llvm/Config/llvm-config.h>
+#include <llvm-12/llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm-12/llvm/IR/Module.h>
+#include <llvm-12/llvm/Support/CachePruning.h>
+#include <llvm-12/llvm/Support/FileSystem.h>
+#include <llvm-12/llvm/Support/FileUtilities.h>
+#include <llvm-12/llvm/Support/MemoryBuffer.h>
+#include <llvm-12/llvm/Support/Path.h>
+#include <llvm-12/llvm/Support/SHA1.h>
+#include <llvm-12/llvm/Support/raw_ostream.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+/// Objects are keyed by a SHA1 of the module's (already optimized) IR, a
+/// description of the target (triple, CPU, features, code generation options)
+/// and the LLVM version, and stored as
+/// <dir>/llvmcache-<key> so that pruneCache can enforce the size limits.
+///
+/// The cache starts out disabled and is switched on by setDirectory. It may be
+/// called from several compile threads at once.
+class KaleidoscopeObjectCache : public ObjectCache {
+  std::string TargetKey;
+  std::string Dir;
+  CachePruningPolicy Policy;
+
+  /// Keys computed by getObject on a miss, reused when the object comes back.
+  std::mutex PendingMutex;
+  DenseMap<const Module *, std::string> Pending;
+
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+  std::atomic<uint64_t> Stores{0};
+
+  std::string computeKey(const Module &M) const {
+    SmallString<4096> IR;
+    raw_svector_ostream OS(IR);
+    M.print(OS, nullptr);
+
+    SHA1 Hasher;
+    Hasher.update(IR);
+    Hasher.update(TargetKey);
+    return toHex(Hasher.final(), true);
+  }
+
+  std::string objectPath(StringRef Key) const {
+    SmallString<256> Path(Dir);
+    sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+  }
+
+public:
+  /// Cap on the cache directory, the oldest objects are evicted beyond it.
+  static constexpr uint64_t DefaultMaxSizeBytes = 64 * 1024 * 1024;
+
+  explicit KaleidoscopeObjectCache(StringRef Target) {
+    setTarget(Target);
+    Policy.MaxSizeBytes = DefaultMaxSizeBytes;
+    Policy.MaxSizeFiles = 16384;
+  }
+
+  ~KaleidoscopeObjectCache() override {
+    // Enforce the limits on what this session added as well.
+    if (isEnabled() && Stores != 0) {
+      Policy.Interval = std::chrono::seconds(0);
+      pruneCache(Dir, Policy);
+    }
+  }
+
+  /// Cache objects in Dir, creating it if needed, and keep it under
+  /// MaxSizeBytes and MaxFiles (0 lifts the respective limit).
+  Error setDirectory(StringRef Dir,
+                     uint64_t MaxSizeBytes = DefaultMaxSizeBytes,
+                     uint64_t MaxFiles = 16384) {
+    if (auto EC = sys::fs::create_directories(Dir))
+      return createStringError(EC, "cannot create object cache directory '%s'",
+                               Dir.str().c_str());
+
+    this->Dir = Dir.str();
+    Policy.MaxSizeBytes = MaxSizeBytes;
+    Policy.MaxSizeFiles = MaxFiles;
+    pruneCache(this->Dir, Policy);
+    return Error::success();
+  }
+
+  /// Key the objects compiled from now on by Target.
+  void setTarget(StringRef Target) {
+    TargetKey = (Target + "|" LLVM_VERSION_STRING).str();
+  }
+
+  bool isEnabled() const { return !Dir.empty(); }
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+  uint64_t getStores() const { return Stores; }
+
+  void printStats(raw_ostream &OS) const {
+    OS << "object cache: " << getHits() << " hits, " << getMisses()
+       << " misses, " << getStores() << " stored\n";
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    if (!isEnabled())
+      return nullptr;
+
+    auto Key = computeKey(*M);
+    if (auto Buffer = MemoryBuffer::getFile(objectPath(Key), -1, false)) {
+      ++Hits;
+      return std::move(*Buffer);
+    }
+
+    ++Misses;
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    Pending[M] = std::move(Key);
+    return nullptr;
+  }
+
+  /// Drop the key getObject computed for M, which failed to compile.
+  void forgetObject(const Module *M) {
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    Pending.erase(M);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    if (!isEnabled())
+      return;
+
+    std::string Key;
+    {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      auto I = Pending.find(M);
+      if (I == Pending.end())
+        return;
+      Key = std::move(I->second);
+      Pending.erase(I);
+    }
+
+    // Write through a temporary so a concurrent reader never sees half an
+    // object. Failing to cache is not an error, the object is still used.
+    auto Path = objectPath(Key);
+    if (auto Err = writeFileAtomically(Path + "-%%%%%%.tmp", Path,
+                                       Obj.getBuffer())) {
+      consumeError(std::move(Err));
+      return;
+    }
+    ++Stores;
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
@@ -0,0 +1,99 @@
+#ifndef HELLO_LLVM_ENGINE_HPP
+#define HELLO_LLVM_ENGINE_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <llvm-12/llvm/ExecutionEngine/Orc/Core.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Embedding
+	//===----------------------------------------------------------------------===//
+
+	/// signature_arity - The number of parameters of a Kaleidoscope function type,
+	/// double(double, ...).
+	template<typename Signature>
+	struct signature_arity;
+
+	template<typename... Args>
+	struct signature_arity<double(Args...)>
+	{
+		static_assert((std::is_same_v<Args, double> && ...), "Kaleidoscope functions take and return doubles");
+
+		constexpr static std::size_t value = sizeof...(Args);
+	};
+
+	/// program - The functions one engine::compile defined. The pointers get hands
+	/// out are plain native functions, calling one costs an indirect call, and they
+	/// stay valid until the program is released, which destroying it does too.
+	class program
+	{
+		friend class engine;
+
+		session* session_;
+		llvm::orc::ResourceTrackerSP tracker_;
+		std::vector<symbol_id> functions_;
+
+		program(session& s, llvm::orc::ResourceTrackerSP tracker)
+			: session_(&s),
+			  tracker_(std::move(tracker)) {}
+
+		[[nodiscard]] std::uintptr_t address(std::string_view name, std::size_t arity) const;
+
+	public:
+		~program();
+
+		program(const program& other) = delete;
+		program& operator=(const program& other) = delete;
+
+		/// get - The function `name` this program defines, nullptr if it defines none
+		/// with that many parameters, or its code fails to compile (after reporting
+		/// why): get<double(double, double)>("add").
+		template<typename Signature>
+		[[nodiscard]] Signature* get(const std::string_view name) const
+		{
+			return reinterpret_cast<Signature*>(address(name, signature_arity<Signature>::value));
+		}
+
+		/// release - Free the code of the functions, which can then be defined again by
+		/// another program. The pointers handed out must not be called anymore, nor
+		/// the functions of later programs calling these, so release those first.
+		/// Top-level expressions kept compiled that call them are freed along.
+		void release();
+	};
+
+	/// engine - Compiles Kaleidoscope source strings into programs, for applications
+	/// embedding the compiler. A program sees the functions of the ones compiled
+	/// before it that are still alive, and the engine must outlive them all. An
+	/// engine is used by one thread at a time, its programs' functions by any.
+	class engine
+	{
+		std::unique_ptr<session> session_;
+
+	public:
+		engine();
+		~engine();
+
+		engine(const engine& other) = delete;
+		engine& operator=(const engine& other) = delete;
+
+		/// get_session - To tune the JIT before compiling anything.
+		[[nodiscard]] session& get_session() noexcept { return *session_; }
+
+		/// compile - Define the functions of `code`, declare its externs and run its
+		/// top-level expressions, in order. Returns nullptr (after reporting why) if
+		/// any of them fails, with nothing of `code` left defined.
+		[[nodiscard]] std::unique_ptr<program> compile(std::string code);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_ENGINE_HPP
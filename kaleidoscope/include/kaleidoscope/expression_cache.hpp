@@ -0,0 +1,90 @@
+#ifndef HELLO_LLVM_EXPRESSION_CACHE_HPP
+#define HELLO_LLVM_EXPRESSION_CACHE_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <llvm-12/llvm/ADT/DenseMap.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/Core.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Expression cache
+	//===----------------------------------------------------------------------===//
+
+	/// expression_cache - Keeps the compiled top-level expressions alive, so one
+	/// submitted again runs the code compiled the first time. Expressions are matched
+	/// on their structure, and an entry is only reused while every function it calls
+	/// still has the version (see session::function_versions) it was compiled
+	/// against; a stale one is freed the next time its expression comes up.
+	class expression_cache
+	{
+	public:
+		using entry_point = double (*)();
+
+	private:
+		struct entry
+		{
+			std::size_t key;
+			std::vector<std::uint32_t> shape;
+			std::vector<std::pair<symbol_id, std::uint32_t>> callees;
+			llvm::orc::ResourceTrackerSP tracker;
+			entry_point function;
+		};
+
+		session& session_;
+
+		/// entries_ - Most recently used first.
+		std::list<entry> entries_;
+		llvm::DenseMap<std::size_t, std::list<entry>::iterator> index_;
+
+		/// shape_/callees_/key_ - Of the expression last passed to find, for insert.
+		std::vector<std::uint32_t> shape_;
+		std::vector<std::pair<symbol_id, std::uint32_t>> callees_;
+		std::size_t key_{0};
+
+		void flatten(const expr_pool& pool, expr_index index);
+
+		std::list<entry>::iterator erase(std::list<entry>::iterator it);
+
+	public:
+		/// capacity - Beyond this many expressions, the least recently used is freed.
+		constexpr static std::size_t capacity = 256;
+
+		/// The expressions are compiled into the JIT of `s`.
+		explicit expression_cache(session& s)
+			: session_(s) {}
+
+		/// Frees the expressions kept alive, the JIT may be shared with other sessions.
+		~expression_cache();
+
+		expression_cache(const expression_cache& other) = delete;
+		expression_cache& operator=(const expression_cache& other) = delete;
+
+		/// find - The entry point compiled for an expression with the same structure
+		/// as the one at `index`, calling the same versions of the same functions, or
+		/// nullptr if it has to be compiled.
+		[[nodiscard]] entry_point find(const expr_pool& pool, expr_index index);
+
+		/// next_name - A symbol name for the anonymous function of the expression to
+		/// compile, unique within the process, whichever sessions share the JIT.
+		[[nodiscard]] std::string next_name();
+
+		/// insert - Keep the entry point compiled for the expression last passed to
+		/// find, along with the tracker of the code behind it.
+		void insert(llvm::orc::ResourceTrackerSP tracker, entry_point function);
+
+		/// erase_callers - Free the expressions calling `name`, before its code is
+		/// removed from the JIT, which would leave them calling into freed memory.
+		void erase_callers(symbol_id name);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_EXPRESSION_CACHE_HPP
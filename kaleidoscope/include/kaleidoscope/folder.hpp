@@ -0,0 +1,60 @@
+#ifndef HELLO_LLVM_FOLDER_HPP
+#define HELLO_LLVM_FOLDER_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <llvm-12/llvm/ADT/DenseMap.h>
+
+#include <cstddef>
+#include <optional>
+#include <span>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Constant folding
+	//===----------------------------------------------------------------------===//
+
+	/// constant_folder - Rewrites the constant parts of an item's expressions into
+	/// numbers before codegen: arithmetic on constants, ifs with a constant condition,
+	/// and calls of pure functions with constant arguments, which it evaluates itself
+	/// within a budget.
+	class constant_folder
+	{
+		using environment = llvm::SmallDenseMap<symbol_id, double, 4>;
+
+		session& session_;
+		expr_pool& pool_;
+
+		/// budget_ - Nodes left to evaluate for this item, shared by all the calls.
+		std::size_t budget_;
+
+		[[nodiscard]] bool fold_call(expr_index index, symbol_id callee, std::span<const double> args);
+
+		[[nodiscard]] std::optional<double> call(symbol_id callee, std::span<const double> args, unsigned depth);
+
+		[[nodiscard]] std::optional<double> evaluate(const expr_pool& pool, expr_index index, environment& env, unsigned depth);
+
+	public:
+		constexpr static std::size_t default_budget = 1 << 16;
+
+		/// max_call_depth - Deeper (recursive) calls are left for run time, this
+		/// evaluator lives on the native stack.
+		constexpr static unsigned max_call_depth = 128;
+
+		constant_folder(session& s, expr_pool& pool, const std::size_t budget = default_budget)
+			: session_(s),
+			  pool_(pool),
+			  budget_(budget) {}
+
+		/// fold - Fold the expression at `index` in place, returns whether it became a number.
+		bool fold(expr_index index);
+
+		/// record_function - Keep the body of function `name`, defined in `pool`, for
+		/// compile time evaluation if it is pure: it calls nothing but itself and
+		/// other pure functions, so it cannot have side effects.
+		static void record_function(session& s, symbol_id name, const expr_pool& pool, expr_index body);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_FOLDER_HPP
@@ -0,0 +1,74 @@
+#ifndef HELLO_LLVM_INTERPRETER_HPP
+#define HELLO_LLVM_INTERPRETER_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <llvm-12/llvm/ADT/DenseMap.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Interpreter
+	//===----------------------------------------------------------------------===//
+
+	/// interpreter - Evaluates a top-level expression by walking its expr_pool,
+	/// calling into the JIT for functions and user defined operators. For a cheap
+	/// expression this is far faster than code generating, compiling and throwing
+	/// away a module just to run it once.
+	class interpreter
+	{
+		session& session_;
+		const expr_pool& pool_;
+
+		/// variables_ - Values of the for loop variables in scope.
+		llvm::DenseMap<symbol_id, double> variables_;
+
+		/// callees_ - Addresses already looked up in the JIT.
+		llvm::DenseMap<symbol_id, std::uintptr_t> callees_;
+
+		/// failed_ - A callee was not found in the JIT, nothing more is called then.
+		bool failed_{false};
+
+		[[nodiscard]] std::optional<std::size_t> cost(expr_index index, std::vector<symbol_id>& scope) const;
+
+		[[nodiscard]] double call(symbol_id callee, const double* args, std::size_t arg_count);
+
+		[[nodiscard]] double walk(expr_index index);
+
+	public:
+		/// jit_threshold - Above this many estimated node evaluations, compiling the
+		/// expression pays for itself.
+		constexpr static std::size_t jit_threshold = 4096;
+
+		/// max_arguments - Calls with more arguments are left to the JIT.
+		constexpr static std::size_t max_arguments = 8;
+
+		interpreter(session& s, const expr_pool& pool)
+			: session_(s),
+			  pool_(pool) {}
+
+		/// cost - Estimated number of node evaluations, or nullopt if the expression is
+		/// not for the interpreter: it refers to something that does not exist (codegen
+		/// reports that), or runs a loop whose trip count is not obvious.
+		[[nodiscard]] std::optional<std::size_t> cost(expr_index index) const;
+
+		/// worth_interpreting - Whether evaluate beats compiling the expression.
+		[[nodiscard]] bool worth_interpreting(const expr_index index) const
+		{
+			const auto c = cost(index);
+			return c && *c <= jit_threshold;
+		}
+
+		/// evaluate - Compute the value the compiled expression would return, or nullopt
+		/// if a function it calls cannot be looked up in the JIT (only declared, say),
+		/// which is reported. Only for expressions cost accepts.
+		[[nodiscard]] std::optional<double> evaluate(expr_index index);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_INTERPRETER_HPP
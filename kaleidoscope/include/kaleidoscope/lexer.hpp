@@ -1,7 +1,11 @@
 #ifndef HELLO_LLVM_LEXER_HPP
 #define HELLO_LLVM_LEXER_HPP
 
-#include <string>
+#include <kaleidoscope/source.hpp>
+#include <kaleidoscope/symbol_table.hpp>
+
+#include <memory>
+#include <string_view>
 
 namespace hello_llvm
 {
@@ -37,10 +41,29 @@ namespace hello_llvm
 			tok_unary = -12
 		};
 
-		std::string identifier_str;// Filled in if tok_identifier
-		double num_val{};          // Filled in if tok_number
+		std::string_view identifier_str;// Filled in if tok_identifier, valid until the next get_token
+		symbol_id identifier_sym{};     // Filled in if tok_identifier, interned identifier_str
+		double num_val{};               // Filled in if tok_number
+
+		/// Reads the standard input by default, interning identifiers into `symbols`.
+		explicit tokenizer(symbol_table& symbols);
+		tokenizer(symbol_table& symbols, std::unique_ptr<source> src);
 
 		int get_token();
+
+	private:
+		symbol_table& symbols_;
+		std::unique_ptr<source> source_;
+
+		/// cursor_/token_begin_ - The next unread byte, and the first byte of the token
+		/// being scanned, which must survive a refill of the source window.
+		const char* cursor_;
+		const char* token_begin_;
+		/// end_ - Cached end of the source window.
+		const char* end_;
+
+		/// peek - The next unread character, or EOF once the source is exhausted.
+		int peek();
 	};
 }// namespace hello_llvm
 
@@ -0,0 +1,68 @@
+#ifndef HELLO_LLVM_LINKER_HPP
+#define HELLO_LLVM_LINKER_HPP
+
+#include <kaleidoscope/ast.hpp>
+#include <kaleidoscope/source.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Parallel loading
+	//===----------------------------------------------------------------------===//
+
+	/// linker - Loads source files that know of each other only through externs, in
+	/// parallel. Each one is parsed and code generated on a pool of workers, by a
+	/// session forked from the library session, into a module of its own. Then the
+	/// references between the files are checked, what they define is merged into
+	/// the library session, and all the modules are added to the JIT together.
+	/// Operators are only known to the file defining them until it is linked.
+	class linker
+	{
+		/// unit - One file, and what it is compiled into.
+		struct unit
+		{
+			std::string name;
+			std::unique_ptr<source> input;
+			std::unique_ptr<session> s;
+
+			/// definitions/externs - What it defines and declares, by its own symbol ids.
+			std::vector<symbol_id> definitions;
+			std::vector<symbol_id> externs;
+			/// expressions - Its top-level expressions, run once it is linked.
+			std::vector<std::string> expressions;
+		};
+
+		session& library_;
+		std::vector<unit> units_;
+
+		static void compile(unit& u);
+
+		/// resolve - Check that no two files define the same function, nor one the library
+		/// session already defines, and that every extern of a function another file
+		/// defines has as many parameters.
+		[[nodiscard]] bool resolve() const;
+
+		/// merge - Give the library session the prototypes and bodies of the units.
+		void merge();
+
+	public:
+		/// `library` must outlive the linker, and is left alone until link.
+		explicit linker(session& library)
+			: library_(library) {}
+
+		/// add - A file to load, called `name` in errors.
+		void add(std::string name, std::unique_ptr<source> input);
+
+		/// link - Compile the files added so far on `threads` workers, link them into the
+		/// library session, and run their top-level expressions, file after file.
+		/// Returns false (after reporting why) if they do not link, with nothing of them
+		/// defined.
+		bool link(unsigned threads);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_LINKER_HPP
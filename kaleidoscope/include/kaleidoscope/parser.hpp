@@ -2,20 +2,41 @@
 #define HELLO_LLVM_PARSER_HPP
 
 #include <map>
+#include <optional>
 
 #include <kaleidoscope/ast.hpp>
 #include <kaleidoscope/lexer.hpp>
 
+#include <llvm-12/llvm/ADT/STLExtras.h>
+
 namespace hello_llvm
 {
 	//===----------------------------------------------------------------------===//
 	// Parser
 	//===----------------------------------------------------------------------===//
 
+	/// top_level_item - An item parser::run_all handled, by the token it starts with:
+	/// tok_def or tok_extern with the name defined or declared, or any other with
+	/// the value of the expression. Left unset if handling it failed, or if the
+	/// expression is left to the pipeline or deferred.
+	struct top_level_item
+	{
+		int token;
+		std::optional<symbol_id> name;
+		std::optional<double> value;
+	};
+
 	class parser
 	{
+		/// session_ - What the items parsed are defined in and compiled with.
+		session& session_;
+
 		tokenizer tok_;
 
+		/// pool_ - Holds the expression nodes of the top-level item being handled, it is
+		/// reset once the item has been code generated.
+		expr_pool pool_;
+
 		/// curr_tok/get_next_token - Provide a simple token buffer.  curr_tok is the current
 		/// token the parser is looking at.  get_next_token reads another token from the
 		/// lexer and updates curr_tok with its results.
@@ -25,24 +46,24 @@ namespace hello_llvm
 		/// expression
 		///   ::= unary binoprhs
 		///   ::= bin_op_rhs
-		std::unique_ptr<expr_ast> parse_expression();
+		expr_index parse_expression();
 
 		/// number_expr ::= number
-		std::unique_ptr<expr_ast> parse_number_expr();
+		expr_index parse_number_expr();
 
 		/// paren_expr ::= '(' expression ')'
-		std::unique_ptr<expr_ast> parse_paren_expr();
+		expr_index parse_paren_expr();
 
 		/// identifier_expr
 		///   ::= identifier
 		///   ::= identifier '(' expression* ')'
-		std::unique_ptr<expr_ast> parse_identifier_expr();
+		expr_index parse_identifier_expr();
 
 		/// if_expr ::= 'if' expression 'then' expression 'else' expression
-		std::unique_ptr<expr_ast>	   parse_if_expr();
+		expr_index	   parse_if_expr();
 
 		/// for_expr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-		std::unique_ptr<expr_ast>	   parse_for_expr();
+		expr_index	   parse_for_expr();
 
 		/// primary
 		///   ::= identifier_expr
@@ -50,16 +71,16 @@ namespace hello_llvm
 		///   ::= paren_expr
 		///   ::= if_expr
 		///   ::= for_expr
-		std::unique_ptr<expr_ast> parse_primary();
+		expr_index parse_primary();
 
 		/// unary
 		///   ::= primary
 		///   ::= '!' unary
-		std::unique_ptr<expr_ast>	   parse_unary_op();
+		expr_index	   parse_unary_op();
 
 		/// bin_op_rhs
 		///   ::= ('+' unary)*
-		std::unique_ptr<expr_ast> parse_bin_op_rhs(int expr_prec, std::unique_ptr<expr_ast> lhs);
+		expr_index parse_bin_op_rhs(int expr_prec, expr_index lhs);
 
 		/// prototype
 		///   ::= id '(' id* ')'
@@ -77,13 +98,33 @@ namespace hello_llvm
 		std::unique_ptr<prototype_ast> parse_extern();
 
 	public:
+		/// Reads the standard input by default.
+		explicit parser(session& s)
+			: session_(s),
+			  tok_(s.symbols) {}
+		parser(session& s, std::unique_ptr<source> src)
+			: session_(s),
+			  tok_(s.symbols, std::move(src)) {}
+
 		[[nodiscard]] int get_curr_token() const { return curr_tok_; }
 
 		int get_next_token() { return curr_tok_ = tok_.get_token(); }
 
-		void handle_definition();
-		void handle_extern();
-		void handle_top_level_expression();
+		/// handle_definition/handle_extern - Return the name of the function defined or
+		/// declared, nullopt if that failed.
+		std::optional<symbol_id> handle_definition();
+		std::optional<symbol_id> handle_extern();
+		/// handle_top_level_expression - Returns the value of the expression, nullopt
+		/// if it could not be evaluated, or is left for session::pipeline to run or
+		/// deferred to session::deferred_expressions.
+		std::optional<double> handle_top_level_expression();
+
+		/// run_all - Handle the items up to the end of the input, skipping the ';'
+		/// between them, and pass each one to `on_item`, which returns whether to go
+		/// on. `on_start`, if given, is first asked with the token an item starts
+		/// with, and returning false stops before handling it, that token current.
+		/// Returns false if either stopped it.
+		bool run_all(llvm::function_ref<bool(const top_level_item&)> on_item, llvm::function_ref<bool(int)> on_start = nullptr);
 	};
 }// namespace hello_llvm
 
@@ -0,0 +1,61 @@
+#ifndef HELLO_LLVM_PIPELINE_HPP
+#define HELLO_LLVM_PIPELINE_HPP
+
+#include <kaleidoscope/ast.hpp>
+#include <kaleidoscope/bounded_queue.hpp>
+
+#include <llvm-12/llvm/ExecutionEngine/Orc/Core.h>
+
+#include <cstddef>
+#include <string>
+#include <thread>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Pipelined execution
+	//===----------------------------------------------------------------------===//
+
+	/// expression_pipeline - The last stage of a pipelined session: runs its top-level
+	/// expressions in source order on a thread of its own. Meanwhile the parser goes
+	/// on with the items after them, and the JIT compiles them on its compile threads.
+	class expression_pipeline
+	{
+		/// job - A value known up front if name is empty, otherwise the anonymous
+		/// function computing it.
+		struct job
+		{
+			double value;
+			std::string name;
+			llvm::orc::ResourceTrackerSP tracker;
+		};
+
+		session& session_;
+		bounded_queue<job> jobs_;
+		std::thread thread_;
+
+		void run();
+
+	public:
+		/// default_capacity - Expressions the parser may get ahead by.
+		constexpr static std::size_t default_capacity = 64;
+
+		explicit expression_pipeline(session& s, std::size_t capacity = default_capacity);
+		~expression_pipeline();
+
+		expression_pipeline(const expression_pipeline& other) = delete;
+		expression_pipeline& operator=(const expression_pipeline& other) = delete;
+
+		/// post - A value computed at compile time, printed in its turn.
+		void post(double value);
+
+		/// post - The compiled function `name`, called in its turn, and removed through
+		/// `tracker` afterwards.
+		void post(std::string name, llvm::orc::ResourceTrackerSP tracker);
+
+		/// finish - Wait for everything posted to have run.
+		void finish();
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_PIPELINE_HPP
@@ -0,0 +1,100 @@
+#ifndef HELLO_LLVM_SERVER_HPP
+#define HELLO_LLVM_SERVER_HPP
+
+#include <kaleidoscope/ast.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Evaluation server
+	//===----------------------------------------------------------------------===//
+
+	/// server - Evaluates top-level expressions for many clients at once. Clients
+	/// connect to a UNIX domain socket and send one request per line, any number of
+	/// top-level expressions, and get one line back for each: their values separated
+	/// by spaces, or "error". Requests are parsed, compiled and run on a pool of
+	/// workers, each with a session forked from the library session. They share its
+	/// JIT and the functions defined in it, and define nothing themselves.
+	///
+	/// A request that cannot be compiled, calls a function the library only declared,
+	/// or runs out of steps (with the JIT's step limits on) gets "error" too, and the
+	/// server goes on with the next one. So does one longer than max_request_size,
+	/// and a client connecting while max_clients others are gets hung up on.
+	class server
+	{
+		struct request
+		{
+			std::string text;
+			std::promise<std::string> response;
+		};
+
+		/// sessions_/workers_ - One session per worker thread.
+		std::vector<std::unique_ptr<session>> sessions_;
+		std::vector<std::thread> workers_;
+
+		std::mutex queue_mutex_;
+		std::condition_variable queue_ready_;
+		std::deque<request> queue_;
+		bool closing_{false};
+
+		/// client_fds_ - The connections being served, each on a thread of its own.
+		std::mutex clients_mutex_;
+		std::condition_variable clients_done_;
+		std::vector<int> client_fds_;
+
+		/// latencies_ - From reading each request to having its response.
+		std::mutex stats_mutex_;
+		std::vector<std::chrono::nanoseconds> latencies_;
+		std::chrono::steady_clock::duration uptime_{};
+
+		/// step_limit_ - Steps each request may take, see KaleidoscopeJIT::setStepLimits.
+		std::uint64_t step_limit_;
+
+		void work(session& s);
+
+		/// evaluate - The response to one request, on the session of the calling worker.
+		[[nodiscard]] std::string evaluate(session& s, std::string text) const;
+
+		[[nodiscard]] std::string submit(std::string text);
+
+		void serve_client(int fd);
+
+	public:
+		/// max_clients - Connections served at once, each takes a thread.
+		constexpr static std::size_t max_clients = 256;
+
+		/// max_request_size - Longest line taken as a request, it is buffered whole.
+		constexpr static std::size_t max_request_size = 64 * 1024;
+
+		/// Starts `workers` workers on forks of `library`, which must outlive the server.
+		/// Each request may take `step_limit` steps, if the library's JIT counts them.
+		server(session& library, unsigned workers, std::uint64_t step_limit = std::numeric_limits<std::uint64_t>::max());
+		~server();
+
+		server(const server& other) = delete;
+		server& operator=(const server& other) = delete;
+
+		/// run - Serve the clients of the socket created at `path` until SIGINT or
+		/// SIGTERM. Returns false (after reporting why) if it cannot be created.
+		bool run(const std::string& path);
+
+		/// print_stats - Requests served by the last run, throughput and latency percentiles.
+		void print_stats(std::ostream& os);
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_SERVER_HPP
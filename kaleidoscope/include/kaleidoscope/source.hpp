@@ -0,0 +1,92 @@
+#ifndef HELLO_LLVM_SOURCE_HPP
+#define HELLO_LLVM_SOURCE_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm
+{
+	class MemoryBuffer;
+}
+
+namespace hello_llvm
+{
+	//===----------------------------------------------------------------------===//
+	// Source input
+	//===----------------------------------------------------------------------===//
+
+	/// source - A window of contiguous input bytes the tokenizer scans by pointer.
+	/// Sources that hold the whole input up front never refill, streaming sources
+	/// slide their window forward on demand.
+	class source
+	{
+	protected:
+		const char* begin_{nullptr};
+		const char* end_{nullptr};
+
+	public:
+		virtual ~source();
+
+		source() = default;
+		source(const source& other) = delete;
+		source(source&& other) noexcept = delete;
+		source& operator=(const source& other) = delete;
+		source& operator=(source&& other) noexcept = delete;
+
+		[[nodiscard]] const char* begin() const noexcept { return begin_; }
+		[[nodiscard]] const char* end() const noexcept { return end_; }
+
+		/// refill - Make more input available. Afterwards the window starts with the
+		/// bytes that were in [keep, end()), followed by whatever was read. Returns false
+		/// once the input is exhausted. The default is for sources that hold everything
+		/// up front and have nothing left to read.
+		virtual bool refill(const char* keep)
+		{
+			begin_ = keep;
+			return false;
+		}
+	};
+
+	/// string_source - Scans an in-memory string owned by the source.
+	class string_source final : public source
+	{
+		std::string storage_;
+
+	public:
+		explicit string_source(std::string str);
+	};
+
+	/// mapped_file_source - Scans a file through llvm::MemoryBuffer, which memory-maps
+	/// it when it is large enough for that to pay off.
+	class mapped_file_source final : public source
+	{
+		std::unique_ptr<llvm::MemoryBuffer> buffer_;
+
+		explicit mapped_file_source(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+	public:
+		~mapped_file_source() override;
+
+		/// open - Returns nullptr (after reporting why) if the file cannot be read.
+		[[nodiscard]] static std::unique_ptr<mapped_file_source> open(const std::string& filename);
+	};
+
+	/// stdin_source - Reads the standard input in chunks. Each read returns whatever
+	/// is available, so an interactive terminal still gets one line at a time.
+	class stdin_source final : public source
+	{
+		std::vector<char> buffer_;
+		/// eof_ - Set once a read finds nothing more, and no read is tried after.
+		bool eof_{false};
+
+	public:
+		constexpr static std::size_t default_chunk_size = 64 * 1024;
+
+		explicit stdin_source(std::size_t chunk_size = default_chunk_size);
+
+		bool refill(const char* keep) override;
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_SOURCE_HPP
@@ -0,0 +1,59 @@
+#ifndef HELLO_LLVM_SYMBOL_TABLE_HPP
+#define HELLO_LLVM_SYMBOL_TABLE_HPP
+
+#include <llvm-12/llvm/ADT/StringMap.h>
+#include <llvm-12/llvm/ADT/StringRef.h>
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace hello_llvm
+{
+	/// symbol_id - Interned name of an identifier, function or operator. Ids are
+	/// dense and stable for the lifetime of the symbol table.
+	using symbol_id = std::uint32_t;
+
+	constexpr symbol_id invalid_symbol = std::numeric_limits<symbol_id>::max();
+
+	//===----------------------------------------------------------------------===//
+	// Symbol table
+	//===----------------------------------------------------------------------===//
+
+	/// symbol_table - Interns names once, when the tokenizer first sees them, so that
+	/// everything downstream resolves names by comparing integers. Each session has
+	/// its own.
+	class symbol_table
+	{
+		llvm::StringMap<symbol_id> ids_;
+		// Views into the keys of ids_, which never move.
+		std::vector<llvm::StringRef> names_;
+
+		/// unary_operators_/binary_operators_ - Ids of "unaryX"/"binaryX" by operator
+		/// character, interned on first use.
+		std::array<symbol_id, 128> unary_operators_;
+		std::array<symbol_id, 128> binary_operators_;
+
+		symbol_id operator_symbol(std::array<symbol_id, 128>& cache, std::string_view prefix, char op);
+
+	public:
+		symbol_table();
+
+		/// A copy gives every name the same id as in `other`.
+		symbol_table(const symbol_table& other);
+		symbol_table& operator=(const symbol_table& other) = delete;
+
+		[[nodiscard]] symbol_id intern(std::string_view name);
+
+		[[nodiscard]] llvm::StringRef name(const symbol_id id) const noexcept { return names_[id]; }
+
+		/// unary_operator/binary_operator - The function implementing a user defined
+		/// operator, `op` must be ascii.
+		[[nodiscard]] symbol_id unary_operator(const char op) { return operator_symbol(unary_operators_, "unary", op); }
+		[[nodiscard]] symbol_id binary_operator(const char op) { return operator_symbol(binary_operators_, "binary", op); }
+	};
+}// namespace hello_llvm
+
+#endif//HELLO_LLVM_SYMBOL_TABLE_HPP
@@ -1,104 +1,185 @@
 #include <kaleidoscope/ast.hpp>
+#include <kaleidoscope/expression_cache.hpp>
 
 #include <llvm-12/llvm/IR/Function.h>
 #include <llvm-12/llvm/IR/IRBuilder.h>
 #include <llvm-12/llvm/IR/LLVMContext.h>
 #include <llvm-12/llvm/IR/Module.h>
-#include <llvm-12/llvm/IR/LegacyPassManager.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+#include <kaleidoscope/details/KaleidoscopeAOT.hpp>
 
 #include <llvm-12/llvm/IR/BasicBlock.h>
 #include <llvm-12/llvm/IR/Constants.h>
 #include <llvm-12/llvm/IR/Verifier.h>
-#include <llvm-12/llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm-12/llvm/Transforms/Scalar.h>
-#include <llvm-12/llvm/Transforms/Scalar/GVN.h>
 
+#include <iomanip>
 #include <iostream>
 
 namespace hello_llvm
 {
-	global_context::global_context()
+	session::session()
 		: exit_on_error("Fatal Error", -1),
-		  jit(exit_on_error(llvm::orc::KaleidoscopeJIT::Create())) { new_module_and_context(); }
+		  jit(exit_on_error(llvm::orc::KaleidoscopeJIT::Create())),
+		  expressions(std::make_unique<expression_cache>(*this)),
+		  results(&std::cerr)
+	{
+		new_module_and_context();
+
+		// Install standard binary operators.
+		// 1 is the lowest precedence.
+		add_bin_op_precedence('<', 10);
+		add_bin_op_precedence('+', 20);
+		add_bin_op_precedence('-', 20);
+		add_bin_op_precedence('*', 40);// highest.
+	}
+
+	session::session(std::shared_ptr<llvm::orc::KaleidoscopeJIT> shared_jit, const symbol_table& known_symbols)
+		: exit_on_error("Fatal Error", -1),
+		  symbols(known_symbols),
+		  jit(std::move(shared_jit)),
+		  expressions(std::make_unique<expression_cache>(*this)),
+		  results(&std::cerr)
+	{
+		new_module_and_context();
+	}
+
+	session::~session() = default;
+
+	std::unique_ptr<session> session::fork()
+	{
+		flush_definitions();
+
+		// The same symbol ids, for the prototypes and bodies to be copied as they are.
+		auto s = std::unique_ptr<session>{new session{jit, symbols}};
+		for (const auto& [name, proto]: functions_proto) { s->functions_proto[name] = std::make_unique<prototype_ast>(*proto); }
+		for (const auto& [name, pure]: pure_functions) { s->pure_functions[name] = std::make_unique<pure_function>(*pure); }
+		s->defined_functions	 = defined_functions;
+		s->function_versions	 = function_versions;
+		s->batch_definitions	 = batch_definitions;
+		s->interpret_expressions = interpret_expressions;
+		s->dump_ir				 = dump_ir;
+		s->results				 = results;
+		s->bin_op_precedence_	 = bin_op_precedence_;
+		return s;
+	}
 
-	void global_context::new_module_and_context()
+	void session::new_module_and_context()
 	{
 		// Open a new context and module.
 		context = std::make_unique<llvm::LLVMContext>();
 		module = std::make_unique<llvm::Module>("my cool jit", *context);
 		module->setDataLayout(jit->getDataLayout());
+		module_functions.clear();
 
 		// Create a new builder for the module.
 		builder = std::make_unique<llvm::IRBuilder<>>(*context);
+	}
+
+	std::pair<std::unique_ptr<llvm::Module>, std::unique_ptr<llvm::LLVMContext>> session::refresh()
+	{
+		auto ret = std::make_pair(std::move(module), std::move(context));
 
-		// Create a new pass manager attached to it.
-		fpm = std::make_unique<llvm::legacy::FunctionPassManager>(module.get());
+		new_module_and_context();
 
-		// Do simple "peephole" optimizations and bit-twiddling options.
-		fpm->add(llvm::createInstructionCombiningPass());
-		// Re-associate expressions.
-		fpm->add(llvm::createReassociatePass());
-		// Eliminate Common SubExpressions.
-		fpm->add(llvm::createGVNPass());
-		// Simplify the control flow graph (deleting unreachable blocks, etc).
-		fpm->add(llvm::createCFGSimplificationPass());
+		return ret;
+	}
 
-		fpm->doInitialization();
+	void session::add_definition()
+	{
+		++pending_definitions;
+		if (!batch_definitions) { flush_definitions(); }
 	}
 
-	std::pair<std::unique_ptr<llvm::Module>, std::unique_ptr<llvm::LLVMContext>> global_context::refresh()
+	void session::flush_definitions()
 	{
-		auto& self = get();
+		if (pending_definitions == 0) { return; }
 
-		auto ret = std::make_pair(std::move(self.module), std::move(self.context));
+		pending_definitions = 0;
+		auto [m, c]			= refresh();
+		if (aot) { exit_on_error(aot->addModule(*m)); }
+		exit_on_error(jit->addModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(c)), tracker));
+	}
 
-		self.new_module_and_context();
+	void session::discard_definitions()
+	{
+		if (pending_definitions == 0) { return; }
 
-		return ret;
+		pending_definitions = 0;
+		auto [m, c]			= refresh();
+		// The module has to go before its context.
+		m.reset();
 	}
 
-	global_context& global_context::get()
+	void session::print_result(const double value) const
 	{
-		static global_context context{};
-		return context;
+		if (!results) { return; }
+
+		*results << "\nEvaluated to -->" << std::setw(8) << std::setprecision(3) << value << "\n\n";
 	}
 
-	int global_context::get_token_precedence(int tok)
+	void session::print_failure() const
+	{
+		if (!results) { return; }
+
+		*results << "\nEvaluated to -->" << std::setw(8) << "error" << "\n\n";
+	}
+
+	int session::get_token_precedence(int tok) const
 	{
 		// todo: is-ascii was deprecated
 		if (!isascii(tok)) { return -1; }
 
 		// Make sure it's a declared bin_op
-		const int tok_prec = get().bin_op_precedence_[static_cast<char>(tok)];
+		const int tok_prec = bin_op_precedence_[static_cast<unsigned char>(tok)];
 		if (tok_prec <= 0) { return -1; }
 		return tok_prec;
 	}
 
-	llvm::Function* global_context::get_function(const std::string& name)
+	llvm::Function* session::get_function(const symbol_id name)
 	{
-		const auto& self = get();
 		// First, see if the function has already been added to the current module.
-		if (auto* func = self.module->getFunction(name); func) { return func; }
+		if (const auto it = module_functions.find(name); it != module_functions.end()) { return it->second; }
 
 		// If not, check whether we can codegen the declaration from some existing
 		// prototype.
-		if (const auto it = self.functions_proto.find(name); it != self.functions_proto.end()) { return it->second->codegen(); }
+		if (const auto it = functions_proto.find(name); it != functions_proto.end()) { return it->second->codegen(*this); }
 
 		// If no existing prototype exists, return nullptr.
 		return nullptr;
 	}
 
-	std::pair<decltype(global_context::functions_proto)::iterator, bool> global_context::insert_or_assign_function(std::unique_ptr<prototype_ast> ast)
+	prototype_ast& session::insert_or_assign_function(std::unique_ptr<prototype_ast> ast)
+	{
+		++function_versions[ast->get_name()];
+
+		auto& slot = functions_proto[ast->get_name()];
+		slot	   = std::move(ast);
+		return *slot;
+	}
+
+	void session::remove_function(const symbol_id name)
 	{
-		// oops, here is a undefined behavior :(
-		return get().functions_proto.insert_or_assign(ast->get_name(), std::move(ast));
+		const auto it = functions_proto.find(name);
+		if (it == functions_proto.end()) { return; }
+
+		if (it->second->is_binary()) { erase_bin_op(it->second->get_operator_name(symbols)); }
+
+		// What was compiled against it is stale, as if it had been redefined, and the
+		// cached expressions calling it go before its code does.
+		++function_versions[name];
+		expressions->erase_callers(name);
+		functions_proto.erase(it);
+		pure_functions.erase(name);
+		defined_functions.erase(name);
+		jit->dropInlineBody(symbols.name(name));
+		exit_on_error(jit->dropBatchKernel(symbols.name(name)));
 	}
 
-	std::unique_ptr<expr_ast> log_error(const char* str)
+	expr_index log_error(const char* str)
 	{
 		std::cerr << "Error: " << str << '\n';
-		return nullptr;
+		return null_expr;
 	}
 
 	std::unique_ptr<prototype_ast> log_error_p(const char* str)
@@ -113,78 +194,163 @@ namespace hello_llvm
 		return nullptr;
 	}
 
-	// out-of-line virtual method
-	expr_ast::~expr_ast() = default;
+	expr_index expr_pool::add(const expr_kind kind, const char op, const std::uint32_t first, const std::uint32_t second)
+	{
+		nodes_.push_back({kind, op, {first, second}});
+		return static_cast<expr_index>(nodes_.size() - 1);
+	}
+
+	expr_index expr_pool::add_number(const double val)
+	{
+		std::array<std::uint32_t, 2> bits;
+		std::memcpy(bits.data(), &val, sizeof(val));
+		return add(expr_kind::number, 0, bits[0], bits[1]);
+	}
+
+	void expr_pool::set_number(const expr_index index, const double val)
+	{
+		std::array<std::uint32_t, 2> bits;
+		std::memcpy(bits.data(), &val, sizeof(val));
+		nodes_[index] = {expr_kind::number, 0, bits};
+	}
+
+	expr_index expr_pool::add_variable(const symbol_id name) { return add(expr_kind::variable, 0, name, 0); }
+
+	expr_index expr_pool::add_unary(const char op, const expr_index operand) { return add(expr_kind::unary, op, operand, 0); }
+
+	expr_index expr_pool::add_binary(const char op, const expr_index lhs, const expr_index rhs) { return add(expr_kind::binary, op, lhs, rhs); }
+
+	expr_index expr_pool::add_call(const symbol_id callee, const std::span<const expr_index> args)
+	{
+		const auto extra = static_cast<std::uint32_t>(extra_.size());
+		extra_.push_back(static_cast<expr_index>(args.size()));
+		extra_.insert(extra_.end(), args.begin(), args.end());
+		return add(expr_kind::call, 0, callee, extra);
+	}
+
+	expr_index expr_pool::add_if(const expr_index cond, const expr_index then, const expr_index else_)
+	{
+		const auto extra = static_cast<std::uint32_t>(extra_.size());
+		extra_.insert(extra_.end(), {then, else_});
+		return add(expr_kind::if_then_else, 0, cond, extra);
+	}
+
+	expr_index expr_pool::add_for(const symbol_id var_name, const expr_index init, const expr_index end, const expr_index step, const expr_index body)
+	{
+		const auto extra = static_cast<std::uint32_t>(extra_.size());
+		extra_.insert(extra_.end(), {init, end, step, body});
+		return add(expr_kind::for_in, 0, var_name, extra);
+	}
+
+	void expr_pool::rename_symbols(const llvm::function_ref<symbol_id(symbol_id)> rename)
+	{
+		for (auto& node: nodes_)
+		{
+			switch (node.kind)
+			{
+				case expr_kind::variable:
+				case expr_kind::call:
+				case expr_kind::for_in:
+					node.operands[0] = rename(node.operands[0]);
+					break;
+				default:
+					break;
+			}
+		}
+	}
 
-	llvm::Value* number_expr_ast::codegen() { return llvm::ConstantFP::get(*global_context::get().context, llvm::APFloat(val_)); }
+	void expr_pool::reset()
+	{
+		nodes_.clear();
+		extra_.clear();
+	}
 
-	llvm::Value* variable_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen(session& s, const expr_index index) const
+	{
+		const auto& node = nodes_[index];
+		switch (node.kind)
+		{
+			case expr_kind::number: return llvm::ConstantFP::get(*s.context, llvm::APFloat(number(node)));
+			case expr_kind::variable: return codegen_variable(s, node);
+			case expr_kind::unary: return codegen_unary(s, node);
+			case expr_kind::binary: return codegen_binary(s, node);
+			case expr_kind::call: return codegen_call(s, node);
+			case expr_kind::if_then_else: return codegen_if(s, node);
+			case expr_kind::for_in: return codegen_for(s, node);
+		}
+
+		return log_error_v("unknown expression kind");
+	}
+
+	llvm::Value* expr_pool::codegen_variable(session& s, const expr_node& node) const
 	{
 		// Look this variable up in the function.
-		auto* v = global_context::get().named_values[name_];
-		if (!v) { return log_error_v("unknown variable name"); }
-		return v;
+		const auto& named_values = s.named_values;
+		const auto	it			 = named_values.find(name(node));
+		if (it == named_values.end() || !it->second) { return log_error_v("unknown variable name"); }
+		return it->second;
 	}
 
-	llvm::Value* unary_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen_unary(session& s, const expr_node& node) const
 	{
-		auto* operand = operand_->codegen();
+		auto* operand = codegen(s, node.operands[0]);
 		if (!operand)
 		{
 			return nullptr;
 		}
 
-		auto* func = global_context::get().get_function(std::string{"unary"} + op_);
+		auto* func = s.get_function(s.symbols.unary_operator(node.op));
 		if (!func)
 		{
 			return log_error_v("unknown unary operator");
 		}
 
-		return global_context::get().builder->CreateCall(func, operand, "unary_op");
+		return s.builder->CreateCall(func, operand, "unary_op");
 	}
 
-	llvm::Value* binary_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen_binary(session& s, const expr_node& node) const
 	{
-		auto* l = lhs_->codegen();
-		auto* r = rhs_->codegen();
+		auto* l = codegen(s, node.operands[0]);
+		auto* r = codegen(s, node.operands[1]);
 		if (!l || !r) { return nullptr; }
 
-		switch (op_)
+		switch (node.op)
 		{
-			case '+': return global_context::get().builder->CreateFAdd(l, r, "add_tmp");
-			case '-': return global_context::get().builder->CreateFSub(l, r, "sub_tmp");
-			case '*': return global_context::get().builder->CreateFMul(l, r, "mul_tmp");
-			case '<': l = global_context::get().builder->CreateFCmpULT(l, r, "cmp_tmp");
+			case '+': return s.builder->CreateFAdd(l, r, "add_tmp");
+			case '-': return s.builder->CreateFSub(l, r, "sub_tmp");
+			case '*': return s.builder->CreateFMul(l, r, "mul_tmp");
+			case '<': l = s.builder->CreateFCmpULT(l, r, "cmp_tmp");
 				// Convert bool 0/1 to double 0.0 or 1.0
-				return global_context::get().builder->CreateUIToFP(l, llvm::Type::getDoubleTy(*global_context::get().context), "bool_tmp");
+				return s.builder->CreateUIToFP(l, llvm::Type::getDoubleTy(*s.context), "bool_tmp");
 			default: break;
 		}
 
 		// If it wasn't a builtin binary operator, it must be a user defined one. Emit
 		// a call to it.
-		auto* func = global_context::get().get_function(std::string{"binary"} + op_);
+		auto* func = s.get_function(s.symbols.binary_operator(node.op));
 		if (!func)
 		{
 			return log_error_v("unknown binary operator");
 		}
 
 		llvm::Value* ops[]{l, r};
-		return global_context::get().builder->CreateCall(func, ops, "binary_op");
+		return s.builder->CreateCall(func, ops, "binary_op");
 	}
 
-	llvm::Value* call_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen_call(session& s, const expr_node& node) const
 	{
 		// Look up the name in the global module table.
-		auto* callee_func = global_context::get().get_function(callee_);
+		auto* callee_func = s.get_function(name(node));
 		if (!callee_func) { return log_error_v("unknown function referenced"); }
 
 		// if argument mismatch error
-		if (callee_func->arg_size() != args_.size()) { return log_error_v("incorrect arguments passed"); }
+		const auto args = call_args(node);
+		if (callee_func->arg_size() != args.size()) { return log_error_v("incorrect arguments passed"); }
 
 		std::vector<llvm::Value*> vec;
-		for (const auto& arg: args_)
+		for (const auto arg: args)
 		{
-			auto* v = arg->codegen();
+			auto* v = codegen(s, arg);
 			if (!v)
 			{
 				return nullptr;
@@ -192,61 +358,61 @@ namespace hello_llvm
 			vec.push_back(v);
 		}
 
-		return global_context::get().builder->CreateCall(callee_func, vec, "call_tmp");
+		return s.builder->CreateCall(callee_func, vec, "call_tmp");
 	}
 
-	llvm::Value* if_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen_if(session& s, const expr_node& node) const
 	{
-		auto& context = global_context::get();
+		const auto [cond, then, else_] = if_operands(node);
 
-		auto* cond_val = cond_->codegen();
+		auto* cond_val = codegen(s, cond);
 		if (!cond_val) { return nullptr; }
 
 		// Convert condition to a bool by comparing non-equal to 0.0.
-		cond_val = context.builder->CreateFCmpONE(cond_val, llvm::ConstantFP::get(*context.context, llvm::APFloat(0.0)), "if_cond");
+		cond_val = s.builder->CreateFCmpONE(cond_val, llvm::ConstantFP::get(*s.context, llvm::APFloat(0.0)), "if_cond");
 
-		auto* func = context.builder->GetInsertBlock()->getParent();
+		auto* func = s.builder->GetInsertBlock()->getParent();
 
 		// Create blocks for the then and else cases.  Insert the 'then' block at the
 		// end of the function.
-		auto* then_bb = llvm::BasicBlock::Create(*context.context, "then", func);
-		auto* else_bb = llvm::BasicBlock::Create(*context.context, "else");
-		auto* merge_bb = llvm::BasicBlock::Create(*context.context, "if_count");
+		auto* then_bb = llvm::BasicBlock::Create(*s.context, "then", func);
+		auto* else_bb = llvm::BasicBlock::Create(*s.context, "else");
+		auto* merge_bb = llvm::BasicBlock::Create(*s.context, "if_count");
 
-		context.builder->CreateCondBr(cond_val, then_bb, else_bb);
+		s.builder->CreateCondBr(cond_val, then_bb, else_bb);
 
 		// Emit then value.
-		context.builder->SetInsertPoint(then_bb);
+		s.builder->SetInsertPoint(then_bb);
 
-		auto* then_val = then_->codegen();
+		auto* then_val = codegen(s, then);
 		if (!then_val) { return nullptr; }
 
-		context.builder->CreateBr(merge_bb);
-		// Codegen of 'then_' can change the current block, update then_bb for the PHI.
-		then_bb = context.builder->GetInsertBlock();
+		s.builder->CreateBr(merge_bb);
+		// Codegen of 'then' can change the current block, update then_bb for the PHI.
+		then_bb = s.builder->GetInsertBlock();
 
 		// Emit else block.
 		func->getBasicBlockList().push_back(else_bb);
-		context.builder->SetInsertPoint(else_bb);
+		s.builder->SetInsertPoint(else_bb);
 
-		auto* else_val = else_->codegen();
+		auto* else_val = codegen(s, else_);
 		if (!else_val) { return nullptr; }
 
-		context.builder->CreateBr(merge_bb);
+		s.builder->CreateBr(merge_bb);
 		// Codegen of 'else_' can change the current block, update else_bb for the PHI.
-		else_bb = context.builder->GetInsertBlock();
+		else_bb = s.builder->GetInsertBlock();
 
 		// Emit merge block.
 		func->getBasicBlockList().push_back(merge_bb);
-		context.builder->SetInsertPoint(merge_bb);
-		auto* pn = context.builder->CreatePHI(llvm::Type::getDoubleTy(*context.context), 2, "if_tmp");
+		s.builder->SetInsertPoint(merge_bb);
+		auto* pn = s.builder->CreatePHI(llvm::Type::getDoubleTy(*s.context), 2, "if_tmp");
 
 		pn->addIncoming(then_val, then_bb);
 		pn->addIncoming(else_val, else_bb);
 		return pn;
 	}
 
-	llvm::Value* for_expr_ast::codegen()
+	llvm::Value* expr_pool::codegen_for(session& s, const expr_node& node) const
 	{
 		// Output for-loop as:
 		//   ...
@@ -264,139 +430,164 @@ namespace hello_llvm
 		//   br end-cond, loop, end-loop
 		// out-loop:
 
-		auto& context = global_context::get();
+		const auto [cond_name, init, end, step, body] = for_operands(node);
 
 		// Emit the init code first, without 'variable' in scope.
-		auto* cond_val = init_->codegen();
+		auto* cond_val = codegen(s, init);
 		if (!cond_val) { return nullptr; }
 
 		// Make the new basic block for the loop header, inserting after current block
-		auto* func = context.builder->GetInsertBlock()->getParent();
-		auto* ph_bb = context.builder->GetInsertBlock();
-		auto* loop_bb = llvm::BasicBlock::Create(*context.context, "loop", func);
+		auto* func = s.builder->GetInsertBlock()->getParent();
+		auto* ph_bb = s.builder->GetInsertBlock();
+		auto* loop_bb = llvm::BasicBlock::Create(*s.context, "loop", func);
 
 		// Insert an explicit fall through from the current block to the loop_bb
-		context.builder->CreateBr(loop_bb);
+		s.builder->CreateBr(loop_bb);
 
 		// Start insertion in loop_bb
-		context.builder->SetInsertPoint(loop_bb);
+		s.builder->SetInsertPoint(loop_bb);
 
 		// Start the PHI node with an entry for init
-		auto* var = context.builder->CreatePHI(llvm::Type::getDoubleTy(*context.context), 2, cond_name_);
+		auto* var = s.builder->CreatePHI(llvm::Type::getDoubleTy(*s.context), 2, s.symbols.name(cond_name));
 		var->addIncoming(cond_val, ph_bb);
 
 		// Within the loop, the variable is defined equal to the PHI node.  If it
 		// shadows an existing variable, we have to restore it, so save it now.
-		auto* old_val = std::exchange(context.named_values[cond_name_], var);
+		auto* old_val = std::exchange(s.named_values[cond_name], var);
 
 		// Emit the body of the loop.  This, like any other expr, can change the
 		// current BB.  Note that we ignore the value computed by the body, but don't
 		// allow an error.
-		if (!body_->codegen()) { return nullptr; }
+		if (!codegen(s, body)) { return nullptr; }
 
 		// Emit the step value.
 		llvm::Value* step_val;
-		if (step_)
+		if (step != null_expr)
 		{
-			step_val = step_->codegen();
+			step_val = codegen(s, step);
 			if (!step_val) { return nullptr; }
 		}
 		else
 		{
 			// If not specified, use 1.0
-			step_val = llvm::ConstantFP::get(*context.context, llvm::APFloat(1.0));
+			step_val = llvm::ConstantFP::get(*s.context, llvm::APFloat(1.0));
 		}
 
-		auto* next_val = context.builder->CreateFAdd(var, step_val, "next_val");
+		auto* next_val = s.builder->CreateFAdd(var, step_val, "next_val");
 
 		// Compute the end condition
-		auto* end_cond = end_->codegen();
+		auto* end_cond = codegen(s, end);
 		if (!end_cond) { return nullptr; }
 
 		// Convert condition to a bool by comparing non-equal to 0.0.
-		end_cond = context.builder->CreateFCmpONE(end_cond, llvm::ConstantFP::get(*context.context, llvm::APFloat(0.0)), "loop_cond");
+		end_cond = s.builder->CreateFCmpONE(end_cond, llvm::ConstantFP::get(*s.context, llvm::APFloat(0.0)), "loop_cond");
 
 		// Create the "after loop" block and insert it.
-		auto* loop_end_bb = context.builder->GetInsertBlock();
-		auto* after_bb = llvm::BasicBlock::Create(*context.context, "after_loop", func);
+		auto* loop_end_bb = s.builder->GetInsertBlock();
+		auto* after_bb = llvm::BasicBlock::Create(*s.context, "after_loop", func);
 
 		// Insert the conditional branch into the end of loop_end_bb
-		context.builder->CreateCondBr(end_cond, loop_bb, after_bb);
+		s.builder->CreateCondBr(end_cond, loop_bb, after_bb);
 
 		// Any new code will be inserted in after_bb
-		context.builder->SetInsertPoint(after_bb);
+		s.builder->SetInsertPoint(after_bb);
 
 		// Add a new entry to the PHI node for the back-edge.
 		var->addIncoming(next_val, loop_end_bb);
 
 		// Restore the un-shadowed variable.
-		std::exchange(context.named_values[cond_name_], old_val);
+		s.named_values[cond_name] = old_val;
 
 		// for expr always returns 0.0.
-		return llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*context.context));
+		return llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(*s.context));
 	}
 
-	llvm::Function* prototype_ast::codegen()
+	llvm::Function* prototype_ast::codegen(session& s)
 	{
 		// Make the function type:  double(double,double) etc.
-		const std::vector doubles(args_.size(), llvm::Type::getDoubleTy(*global_context::get().context));
+		const std::vector doubles(args_.size(), llvm::Type::getDoubleTy(*s.context));
 
-		auto* func_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*global_context::get().context), doubles, false);
+		auto* func_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*s.context), doubles, false);
 
-		auto* func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, name_, global_context::get().module.get());
+		const auto& symbols = s.symbols;
+
+		// Declared or defined earlier in the same module, which a second one would only
+		// shadow under a renamed copy. Deferred expressions keep every item in it.
+		if (auto* existing = s.module->getFunction(symbols.name(name_)); existing && existing->getFunctionType() == func_type)
+		{
+			s.module_functions[name_] = existing;
+			return existing;
+		}
+
+		auto* func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, symbols.name(name_), s.module.get());
+		s.module_functions[name_] = func;
 
 		// Set names for all arguments.
 		decltype(args_.size()) index = 0;
-		for (auto& arg: func->args()) { arg.setName(args_[index++]); }
+		for (auto& arg: func->args()) { arg.setName(symbols.name(args_[index++])); }
 
 		return func;
 	}
 
-	llvm::Function* function_ast::codegen()
+	llvm::Function* function_ast::codegen(session& s)
 	{
-		auto& context = global_context::get();
+		// Checked up front, a prototype that is rejected must not replace the one in use.
+		if (s.defined_functions.count(proto_->get_name()))
+		{
+			log_error("function cannot be redefined");
+			return nullptr;
+		}
+
 		// Transfer ownership of the prototype to the Functions Proto map, but keep a
 		// reference to it for use below.
-		const auto& p = *proto_;
-		global_context::insert_or_assign_function(std::move(proto_));
+		const auto& p = s.insert_or_assign_function(std::move(proto_));
 
-		auto* func = global_context::get_function(p.get_name());
+		auto* func = s.get_function(p.get_name());
 		if (!func) { return nullptr; }
 
 		// If this is an operator, install it.
 		if (p.is_binary())
 		{
-			global_context::add_bin_op_precedence(p.get_operator_name(), p.get_precedence());
+			s.add_bin_op_precedence(p.get_operator_name(s.symbols), p.get_precedence());
 		}
 
 		// Create a new basic block to start insertion into.
-		auto* bb = llvm::BasicBlock::Create(*global_context::get().context, "entry", func);
-		context.builder->SetInsertPoint(bb);
+		auto* bb = llvm::BasicBlock::Create(*s.context, "entry", func);
+		s.builder->SetInsertPoint(bb);
 
 		// Record the function arguments in the named_values map.
-		context.named_values.clear();
-		for (auto& arg: func->args()) { context.named_values[std::string{arg.getName()}] = &arg; }
+		s.named_values.clear();
+		for (auto& arg: func->args()) { s.named_values[p.get_args()[arg.getArgNo()]] = &arg; }
 
-		if (auto* ret = body_->codegen(); ret)
+		if (auto* ret = pool_->codegen(s, body_); ret)
 		{
 			// Finish off the function.
-			context.builder->CreateRet(ret);
+			s.builder->CreateRet(ret);
 
-			// Validate the generated code, checking for consistency.
+			// Validate the generated code, checking for consistency. The JIT optimizes
+			// whole modules, at the level it is set to.
 			verifyFunction(*func);
 
-			// Run the optimizer on the function.
-			context.fpm->run(*func);
-
+			s.defined_functions.insert(p.get_name());
 			return func;
 		}
 
-		// Error reading body, remove function.
-		func->eraseFromParent();
+		// Error reading body, remove function. Functions earlier in the same module
+		// may already call it, in which case only the body goes and it is left
+		// declared, as an extern would be.
+		if (func->use_empty())
+		{
+			func->eraseFromParent();
+			s.module_functions.erase(p.get_name());
+		}
+		else
+		{
+			func->deleteBody();
+		}
 
 		if (p.is_binary())
 		{
-			global_context::erase_bin_op(p.get_operator_name());
+			s.erase_bin_op(p.get_operator_name(s.symbols));
 		}
 
 		return nullptr;
@@ -0,0 +1,71 @@
+#include <kaleidoscope/batch.hpp>
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <array>
+#include <utility>
+
+namespace hello_llvm
+{
+	namespace
+	{
+		template<std::size_t>
+		using column = const double*;
+
+		template<std::size_t... I>
+		void invoke(const std::uintptr_t address, const double* const* columns, double* out, const std::size_t n, std::index_sequence<I...>)
+		{
+			using kernel_type = void (*)(column<I>..., double*, std::size_t);
+			reinterpret_cast<kernel_type>(address)(columns[I]..., out, n);
+		}
+
+		/// invokers - Call a native kernel by the number of columns.
+		constexpr auto invokers = []<std::size_t... N>(std::index_sequence<N...>)
+		{
+			return std::array<void (*)(std::uintptr_t, const double* const*, double*, std::size_t), sizeof...(N)>{
+					[](const std::uintptr_t address, const double* const* columns, double* out, const std::size_t n) { invoke(address, columns, out, n, std::make_index_sequence<N>{}); }...};
+		}(std::make_index_sequence<batch_kernel::max_arguments + 1>{});
+	}// namespace
+
+	std::optional<batch_kernel> batch_kernel::compile(session& s, const std::string_view name)
+	{
+		const auto it = s.functions_proto.find(s.symbols.intern(name));
+		if (it == s.functions_proto.end())
+		{
+			log_error("unknown function for a batch kernel");
+			return std::nullopt;
+		}
+
+		const auto arity = it->second->get_args().size();
+		if (arity > max_arguments)
+		{
+			log_error("too many parameters for a batch kernel");
+			return std::nullopt;
+		}
+
+		// The kernel inlines the function, its module has to be in the JIT.
+		s.flush_definitions();
+
+		// Fails if the function is only declared, or its kernel does not compile.
+		auto symbol = s.jit->lookupBatch({name.data(), name.size()}, static_cast<unsigned>(arity));
+		if (!symbol)
+		{
+			llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), "Error: ");
+			return std::nullopt;
+		}
+		return batch_kernel{static_cast<std::uintptr_t>(symbol->getAddress()), arity};
+	}
+
+	bool batch_kernel::operator()(const std::span<const double* const> columns, double* out, const std::size_t n) const
+	{
+		// The kernel reads one pointer per parameter, however many there are.
+		if (columns.size() != arity_)
+		{
+			log_error("a batch kernel needs one column per parameter");
+			return false;
+		}
+
+		invokers[arity_](address_, columns.data(), out, n);
+		return true;
+	}
+}// namespace hello_llvm
@@ -0,0 +1,90 @@
+#include <kaleidoscope/engine.hpp>
+#include <kaleidoscope/parser.hpp>
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/Support/TargetSelect.h>
+
+#include <algorithm>
+#include <mutex>
+
+namespace hello_llvm
+{
+	program::~program()
+	{
+		release();
+	}
+
+	std::uintptr_t program::address(const std::string_view name, const std::size_t arity) const
+	{
+		if (!tracker_) { return 0; }
+
+		const auto id = session_->symbols.intern(name);
+		if (std::find(functions_.begin(), functions_.end(), id) == functions_.end() ||
+			session_->functions_proto.find(id)->second->get_args().size() != arity)
+		{
+			return 0;
+		}
+
+		// A body that fails to materialize is reported, the host carries on.
+		auto symbol = session_->jit->lookup({name.data(), name.size()});
+		if (!symbol)
+		{
+			llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), "Error: ");
+			return 0;
+		}
+		return static_cast<std::uintptr_t>(symbol->getAddress());
+	}
+
+	void program::release()
+	{
+		if (!tracker_) { return; }
+
+		for (const auto name: functions_) { session_->remove_function(name); }
+		functions_.clear();
+
+		session_->exit_on_error(tracker_->remove());
+		tracker_ = nullptr;
+	}
+
+	engine::engine()
+	{
+		static std::once_flag native_target;
+		std::call_once(native_target, [] {
+			llvm::InitializeNativeTarget();
+			llvm::InitializeNativeTargetAsmPrinter();
+			llvm::InitializeNativeTargetAsmParser();
+		});
+
+		session_ = std::make_unique<session>();
+		session_->dump_ir			= false;
+		session_->results			= nullptr;
+		session_->batch_definitions = true;
+	}
+
+	engine::~engine() = default;
+
+	std::unique_ptr<program> engine::compile(std::string code)
+	{
+		auto& s = *session_;
+
+		// Everything code defines goes under the program's own tracker.
+		auto compiled = std::unique_ptr<program>{new program{s, s.jit->getMainJITDylib().createResourceTracker()}};
+		s.tracker	  = compiled->tracker_;
+
+		parser p{s, std::make_unique<string_source>(std::move(code))};
+
+		const auto ok = p.run_all([&](const top_level_item& item) {
+			if (item.token == tokenizer::tok_def && item.name) { compiled->functions_.push_back(*item.name); }
+			return item.name || item.value;
+		});
+
+		if (ok) { s.flush_definitions(); }
+		else { s.discard_definitions(); }
+		s.tracker = nullptr;
+
+		// Destroying the program takes back what was defined before the error.
+		if (!ok) { return nullptr; }
+		return compiled;
+	}
+}// namespace hello_llvm
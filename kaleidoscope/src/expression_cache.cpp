@@ -0,0 +1,133 @@
+#include <kaleidoscope/expression_cache.hpp>
+
+#include <llvm-12/llvm/ADT/Hashing.h>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+namespace hello_llvm
+{
+	namespace
+	{
+		std::atomic<std::size_t> next_id{0};
+	}// namespace
+
+	expression_cache::~expression_cache()
+	{
+		while (!entries_.empty()) { erase(entries_.begin()); }
+	}
+
+	void expression_cache::flatten(const expr_pool& pool, const expr_index index)
+	{
+		const auto callee = [&](const symbol_id name) { callees_.emplace_back(name, session_.function_versions.lookup(name)); };
+
+		// Pre-order, each kind has a fixed layout so the result is unambiguous.
+		const auto& node = pool[index];
+		shape_.push_back(static_cast<std::uint32_t>(node.kind) | static_cast<std::uint32_t>(static_cast<unsigned char>(node.op)) << 8);
+		switch (node.kind)
+		{
+			case expr_kind::number:
+				// The bits, so that 0.0 and -0.0 differ.
+				shape_.push_back(node.operands[0]);
+				shape_.push_back(node.operands[1]);
+				break;
+			case expr_kind::variable:
+				shape_.push_back(expr_pool::name(node));
+				break;
+			case expr_kind::unary:
+				callee(session_.symbols.unary_operator(node.op));
+				flatten(pool, node.operands[0]);
+				break;
+			case expr_kind::binary:
+				if (node.op != '+' && node.op != '-' && node.op != '*' && node.op != '<') { callee(session_.symbols.binary_operator(node.op)); }
+				flatten(pool, node.operands[0]);
+				flatten(pool, node.operands[1]);
+				break;
+			case expr_kind::call:
+			{
+				const auto args = pool.call_args(node);
+				callee(expr_pool::name(node));
+				shape_.push_back(expr_pool::name(node));
+				shape_.push_back(static_cast<std::uint32_t>(args.size()));
+				for (const auto arg: args) { flatten(pool, arg); }
+				break;
+			}
+			case expr_kind::if_then_else:
+			{
+				const auto [cond, then, else_] = pool.if_operands(node);
+				flatten(pool, cond);
+				flatten(pool, then);
+				flatten(pool, else_);
+				break;
+			}
+			case expr_kind::for_in:
+			{
+				const auto [var_name, init, end, step, body] = pool.for_operands(node);
+				shape_.push_back(var_name);
+				shape_.push_back(step != null_expr);
+				flatten(pool, init);
+				flatten(pool, end);
+				if (step != null_expr) { flatten(pool, step); }
+				flatten(pool, body);
+				break;
+			}
+		}
+	}
+
+	std::list<expression_cache::entry>::iterator expression_cache::erase(const std::list<entry>::iterator it)
+	{
+		session_.exit_on_error(it->tracker->remove());
+		index_.erase(it->key);
+		return entries_.erase(it);
+	}
+
+	expression_cache::entry_point expression_cache::find(const expr_pool& pool, const expr_index index)
+	{
+		shape_.clear();
+		callees_.clear();
+		flatten(pool, index);
+
+		// With the top bit clear, a key never collides with DenseMap's empty and
+		// tombstone keys.
+		key_ = static_cast<std::size_t>(llvm::hash_combine_range(shape_.begin(), shape_.end())) & (~std::size_t{0} >> 1);
+
+		const auto it = index_.find(key_);
+		if (it == index_.end()) { return nullptr; }
+
+		const auto e = it->second;
+		if (e->shape != shape_ || e->callees != callees_)
+		{
+			// Either another expression with the same hash, or a callee was redefined
+			// since. Both are replaced by the one about to be compiled.
+			erase(e);
+			return nullptr;
+		}
+
+		entries_.splice(entries_.begin(), entries_, e);
+		return e->function;
+	}
+
+	std::string expression_cache::next_name()
+	{
+		return "__anon_expr__." + std::to_string(next_id.fetch_add(1, std::memory_order_relaxed));
+	}
+
+	void expression_cache::insert(llvm::orc::ResourceTrackerSP tracker, const entry_point function)
+	{
+		if (entries_.size() == capacity) { erase(std::prev(entries_.end())); }
+
+		entries_.push_front({key_, shape_, callees_, std::move(tracker), function});
+		index_[key_] = entries_.begin();
+	}
+
+	void expression_cache::erase_callers(const symbol_id name)
+	{
+		for (auto it = entries_.begin(); it != entries_.end();)
+		{
+			const auto calls = std::any_of(it->callees.begin(), it->callees.end(), [name](const auto& callee) { return callee.first == name; });
+			it				 = calls ? erase(it) : std::next(it);
+		}
+	}
+}// namespace hello_llvm
@@ -0,0 +1,271 @@
+#include <kaleidoscope/folder.hpp>
+
+#include <llvm-12/llvm/ADT/SmallVector.h>
+
+namespace hello_llvm
+{
+	namespace
+	{
+		/// is_true - The fcmp one against 0.0 that codegen uses for conditions.
+		[[nodiscard]] constexpr bool is_true(const double value) noexcept
+		{
+			return value < 0.0 || value > 0.0;
+		}
+
+		/// builtin - The binary operators codegen emits inline, nullopt for a user
+		/// defined one.
+		[[nodiscard]] constexpr std::optional<double> builtin(const char op, const double l, const double r) noexcept
+		{
+			switch (op)
+			{
+				case '+': return l + r;
+				case '-': return l - r;
+				case '*': return l * r;
+				// fcmp ult, true if either side is NaN.
+				case '<': return !(l >= r) ? 1.0 : 0.0;
+				default: return std::nullopt;
+			}
+		}
+
+		/// calls_only_pure - Whether every function the expression calls is pure, or `self`.
+		[[nodiscard]] bool calls_only_pure(session& s, const expr_pool& pool, const expr_index index, const symbol_id self)
+		{
+			const auto& pure = s.pure_functions;
+			const auto	callee_is_pure = [&](const symbol_id callee) { return callee == self || pure.count(callee); };
+
+			const auto& node = pool[index];
+			switch (node.kind)
+			{
+				case expr_kind::number:
+				case expr_kind::variable: return true;
+				case expr_kind::unary:
+					return callee_is_pure(s.symbols.unary_operator(node.op)) &&
+						   calls_only_pure(s, pool, node.operands[0], self);
+				case expr_kind::binary:
+					return (builtin(node.op, 0, 0) || callee_is_pure(s.symbols.binary_operator(node.op))) &&
+						   calls_only_pure(s, pool, node.operands[0], self) &&
+						   calls_only_pure(s, pool, node.operands[1], self);
+				case expr_kind::call:
+				{
+					if (!callee_is_pure(expr_pool::name(node))) { return false; }
+					for (const auto arg: pool.call_args(node))
+					{
+						if (!calls_only_pure(s, pool, arg, self)) { return false; }
+					}
+					return true;
+				}
+				case expr_kind::if_then_else:
+				{
+					const auto [cond, then, else_] = pool.if_operands(node);
+					return calls_only_pure(s, pool, cond, self) && calls_only_pure(s, pool, then, self) && calls_only_pure(s, pool, else_, self);
+				}
+				case expr_kind::for_in:
+				{
+					const auto [var_name, init, end, step, body] = pool.for_operands(node);
+					return calls_only_pure(s, pool, init, self) &&
+						   calls_only_pure(s, pool, end, self) &&
+						   (step == null_expr || calls_only_pure(s, pool, step, self)) &&
+						   calls_only_pure(s, pool, body, self);
+				}
+			}
+
+			return false;
+		}
+	}// namespace
+
+	void constant_folder::record_function(session& s, const symbol_id name, const expr_pool& pool, const expr_index body)
+	{
+		if (!calls_only_pure(s, pool, body, name)) { return; }
+
+		s.pure_functions[name] = std::make_unique<pure_function>(pure_function{pool, body});
+	}
+
+	bool constant_folder::fold(const expr_index index)
+	{
+		// A copy, the node may be rewritten below.
+		const auto node = pool_[index];
+		switch (node.kind)
+		{
+			case expr_kind::number: return true;
+			case expr_kind::variable: return false;
+			case expr_kind::unary:
+			{
+				if (!fold(node.operands[0])) { return false; }
+
+				const double operand = expr_pool::number(pool_[node.operands[0]]);
+				return fold_call(index, session_.symbols.unary_operator(node.op), {&operand, 1});
+			}
+			case expr_kind::binary:
+			{
+				// Fold both sides, even if one of them is not constant.
+				const auto l_const = fold(node.operands[0]);
+				const auto r_const = fold(node.operands[1]);
+				if (!l_const || !r_const) { return false; }
+
+				const double ops[]{expr_pool::number(pool_[node.operands[0]]), expr_pool::number(pool_[node.operands[1]])};
+				if (const auto value = builtin(node.op, ops[0], ops[1]))
+				{
+					pool_.set_number(index, *value);
+					return true;
+				}
+				return fold_call(index, session_.symbols.binary_operator(node.op), ops);
+			}
+			case expr_kind::call:
+			{
+				const auto args = pool_.call_args(node);
+
+				auto all_const = true;
+				for (const auto arg: args) { all_const = fold(arg) && all_const; }
+				if (!all_const) { return false; }
+
+				llvm::SmallVector<double, 8> values;
+				for (const auto arg: args) { values.push_back(expr_pool::number(pool_[arg])); }
+				return fold_call(index, expr_pool::name(node), values);
+			}
+			case expr_kind::if_then_else:
+			{
+				const auto [cond, then, else_] = pool_.if_operands(node);
+				if (fold(cond))
+				{
+					// Only the branch taken is left.
+					const auto taken	= is_true(expr_pool::number(pool_[cond])) ? then : else_;
+					const auto is_const = fold(taken);
+					pool_.replace(index, taken);
+					return is_const;
+				}
+
+				(void)fold(then);
+				(void)fold(else_);
+				return false;
+			}
+			case expr_kind::for_in:
+			{
+				// A loop runs for its side effects, only fold inside it.
+				const auto [var_name, init, end, step, body] = pool_.for_operands(node);
+				(void)fold(init);
+				(void)fold(end);
+				if (step != null_expr) { (void)fold(step); }
+				(void)fold(body);
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool constant_folder::fold_call(const expr_index index, const symbol_id callee, const std::span<const double> args)
+	{
+		const auto value = call(callee, args, 0);
+		if (!value) { return false; }
+
+		pool_.set_number(index, *value);
+		return true;
+	}
+
+	std::optional<double> constant_folder::call(const symbol_id callee, const std::span<const double> args, const unsigned depth)
+	{
+		const auto it = session_.pure_functions.find(callee);
+		if (it == session_.pure_functions.end() || depth >= max_call_depth) { return std::nullopt; }
+
+		// Leave a wrong number of arguments for codegen to report.
+		const auto& params = session_.functions_proto.find(callee)->second->get_args();
+		if (params.size() != args.size()) { return std::nullopt; }
+
+		environment env;
+		for (std::size_t i = 0; i < params.size(); ++i) { env[params[i]] = args[i]; }
+
+		return evaluate(it->second->pool, it->second->body, env, depth + 1);
+	}
+
+	std::optional<double> constant_folder::evaluate(const expr_pool& pool, const expr_index index, environment& env, const unsigned depth)
+	{
+		if (budget_ == 0) { return std::nullopt; }
+		--budget_;
+
+		const auto& node = pool[index];
+		switch (node.kind)
+		{
+			case expr_kind::number: return expr_pool::number(node);
+			case expr_kind::variable:
+			{
+				const auto it = env.find(expr_pool::name(node));
+				if (it == env.end()) { return std::nullopt; }
+				return it->second;
+			}
+			case expr_kind::unary:
+			{
+				const auto operand = evaluate(pool, node.operands[0], env, depth);
+				if (!operand) { return std::nullopt; }
+				return call(session_.symbols.unary_operator(node.op), {&*operand, 1}, depth);
+			}
+			case expr_kind::binary:
+			{
+				const auto l = evaluate(pool, node.operands[0], env, depth);
+				if (!l) { return std::nullopt; }
+				const auto r = evaluate(pool, node.operands[1], env, depth);
+				if (!r) { return std::nullopt; }
+
+				if (const auto value = builtin(node.op, *l, *r)) { return value; }
+
+				const double ops[]{*l, *r};
+				return call(session_.symbols.binary_operator(node.op), ops, depth);
+			}
+			case expr_kind::call:
+			{
+				llvm::SmallVector<double, 8> values;
+				for (const auto arg: pool.call_args(node))
+				{
+					const auto value = evaluate(pool, arg, env, depth);
+					if (!value) { return std::nullopt; }
+					values.push_back(*value);
+				}
+				return call(expr_pool::name(node), values, depth);
+			}
+			case expr_kind::if_then_else:
+			{
+				const auto [cond, then, else_] = pool.if_operands(node);
+
+				const auto cond_val = evaluate(pool, cond, env, depth);
+				if (!cond_val) { return std::nullopt; }
+				return evaluate(pool, is_true(*cond_val) ? then : else_, env, depth);
+			}
+			case expr_kind::for_in:
+			{
+				// Same order as the loop codegen emits: body, step, then the end condition,
+				// all with the variable still holding the value of this trip.
+				const auto [var_name, init, end, step, body] = pool.for_operands(node);
+
+				auto var = evaluate(pool, init, env, depth);
+				if (!var) { return std::nullopt; }
+
+				std::optional<double> shadowed;
+				if (const auto it = env.find(var_name); it != env.end()) { shadowed = it->second; }
+
+				while (true)
+				{
+					env[var_name] = *var;
+
+					if (!evaluate(pool, body, env, depth)) { return std::nullopt; }
+
+					auto step_val = std::optional<double>{1.0};
+					if (step != null_expr) { step_val = evaluate(pool, step, env, depth); }
+					if (!step_val) { return std::nullopt; }
+
+					const auto end_cond = evaluate(pool, end, env, depth);
+					if (!end_cond) { return std::nullopt; }
+
+					*var += *step_val;
+					if (!is_true(*end_cond)) { break; }
+				}
+
+				if (shadowed) { env[var_name] = *shadowed; }
+				else { env.erase(var_name); }
+
+				// for expr always returns 0.0.
+				return 0.0;
+			}
+		}
+
+		return std::nullopt;
+	}
+}// namespace hello_llvm
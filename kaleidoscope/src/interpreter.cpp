@@ -0,0 +1,257 @@
+#include <kaleidoscope/interpreter.hpp>
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <utility>
+
+namespace hello_llvm
+{
+	namespace
+	{
+		/// capped - Anything past the threshold is simply "too expensive", capping
+		/// keeps the arithmetic on costs from overflowing.
+		[[nodiscard]] constexpr std::size_t capped(const std::size_t cost) noexcept
+		{
+			return std::min(cost, interpreter::jit_threshold + 1);
+		}
+
+		/// is_true - The fcmp one against 0.0 that codegen uses for conditions, which
+		/// unlike != is false for NaN.
+		[[nodiscard]] constexpr bool is_true(const double value) noexcept
+		{
+			return value < 0.0 || value > 0.0;
+		}
+
+		/// has_arity - Whether a prototype named `name` exists and takes `arity` arguments.
+		[[nodiscard]] bool has_arity(const session& s, const symbol_id name, const std::size_t arity)
+		{
+			const auto& protos = s.functions_proto;
+			const auto	it	   = protos.find(name);
+			return it != protos.end() && it->second->get_args().size() == arity;
+		}
+
+		template<std::size_t... I>
+		double invoke(const std::uintptr_t address, const double* args, std::index_sequence<I...>)
+		{
+			using function_type = double (*)(decltype(I, 0.0)...);
+			return reinterpret_cast<function_type>(address)(args[I]...);
+		}
+
+		/// invokers - Call a native double(double...) by the number of arguments.
+		constexpr auto invokers = []<std::size_t... N>(std::index_sequence<N...>)
+		{
+			return std::array<double (*)(std::uintptr_t, const double*), sizeof...(N)>{
+					[](const std::uintptr_t address, const double* args) { return invoke(address, args, std::make_index_sequence<N>{}); }...};
+		}(std::make_index_sequence<interpreter::max_arguments + 1>{});
+	}// namespace
+
+	std::optional<std::size_t> interpreter::cost(const expr_index index) const
+	{
+		std::vector<symbol_id> scope;
+		return cost(index, scope);
+	}
+
+	std::optional<std::size_t> interpreter::cost(const expr_index index, std::vector<symbol_id>& scope) const
+	{
+		const auto& node = pool_[index];
+		switch (node.kind)
+		{
+			case expr_kind::number: return 1;
+			case expr_kind::variable:
+			{
+				if (std::find(scope.begin(), scope.end(), expr_pool::name(node)) == scope.end()) { return std::nullopt; }
+				return 1;
+			}
+			case expr_kind::unary:
+			{
+				if (!has_arity(session_, session_.symbols.unary_operator(node.op), 1)) { return std::nullopt; }
+
+				const auto operand = cost(node.operands[0], scope);
+				if (!operand) { return std::nullopt; }
+				return capped(1 + *operand);
+			}
+			case expr_kind::binary:
+			{
+				if (node.op != '+' && node.op != '-' && node.op != '*' && node.op != '<' &&
+					!has_arity(session_, session_.symbols.binary_operator(node.op), 2)) { return std::nullopt; }
+
+				const auto l = cost(node.operands[0], scope);
+				const auto r = cost(node.operands[1], scope);
+				if (!l || !r) { return std::nullopt; }
+				return capped(1 + *l + *r);
+			}
+			case expr_kind::call:
+			{
+				const auto args = pool_.call_args(node);
+				if (args.size() > max_arguments || !has_arity(session_, expr_pool::name(node), args.size())) { return std::nullopt; }
+
+				std::size_t total = 1;
+				for (const auto arg: args)
+				{
+					const auto c = cost(arg, scope);
+					if (!c) { return std::nullopt; }
+					total = capped(total + *c);
+				}
+				return total;
+			}
+			case expr_kind::if_then_else:
+			{
+				const auto [cond, then, else_] = pool_.if_operands(node);
+
+				const auto c = cost(cond, scope);
+				const auto t = cost(then, scope);
+				const auto e = cost(else_, scope);
+				if (!c || !t || !e) { return std::nullopt; }
+				return capped(1 + *c + std::max(*t, *e));
+			}
+			case expr_kind::for_in:
+			{
+				const auto [var_name, init, end, step, body] = pool_.for_operands(node);
+
+				const auto init_cost = cost(init, scope);
+				if (!init_cost) { return std::nullopt; }
+
+				scope.push_back(var_name);
+				const auto body_cost = cost(body, scope);
+				const auto end_cost	 = cost(end, scope);
+				const auto step_cost = step == null_expr ? std::optional<std::size_t>{0} : cost(step, scope);
+				scope.pop_back();
+				if (!body_cost || !end_cost || !step_cost) { return std::nullopt; }
+
+				// Only count the trips of the common `for i = a, i < b, c` with constant
+				// bounds, any other loop may run for arbitrarily long.
+				const auto& init_node = pool_[init];
+				const auto& end_node  = pool_[end];
+				if (init_node.kind != expr_kind::number ||
+					end_node.kind != expr_kind::binary ||
+					end_node.op != '<' ||
+					pool_[end_node.operands[0]].kind != expr_kind::variable ||
+					expr_pool::name(pool_[end_node.operands[0]]) != var_name ||
+					pool_[end_node.operands[1]].kind != expr_kind::number ||
+					(step != null_expr && pool_[step].kind != expr_kind::number)) { return std::nullopt; }
+
+				const auto first = expr_pool::number(init_node);
+				const auto limit = expr_pool::number(pool_[end_node.operands[1]]);
+				const auto delta = step == null_expr ? 1.0 : expr_pool::number(pool_[step]);
+
+				// The body runs once before the condition is first checked.
+				double trips = 1;
+				if (first < limit)
+				{
+					if (!(delta > 0)) { return std::nullopt; }
+					trips += std::ceil((limit - first) / delta);
+				}
+				if (!(trips <= static_cast<double>(jit_threshold))) { return capped(jit_threshold + 1); }
+
+				return capped(1 + *init_cost + static_cast<std::size_t>(trips) * (*body_cost + *end_cost + *step_cost));
+			}
+		}
+
+		return std::nullopt;
+	}
+
+	double interpreter::call(const symbol_id callee, const double* args, const std::size_t arg_count)
+	{
+		if (failed_) { return 0.0; }
+
+		auto [it, inserted] = callees_.try_emplace(callee, 0);
+		if (inserted)
+		{
+			auto symbol = session_.jit->lookup(session_.symbols.name(callee));
+			if (!symbol)
+			{
+				llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), "Error: ");
+				callees_.erase(it);
+				failed_ = true;
+				return 0.0;
+			}
+			it->second = static_cast<std::uintptr_t>(symbol->getAddress());
+		}
+
+		return invokers[arg_count](it->second, args);
+	}
+
+	std::optional<double> interpreter::evaluate(const expr_index index)
+	{
+		failed_			 = false;
+		const auto value = walk(index);
+		if (failed_) { return std::nullopt; }
+		return value;
+	}
+
+	double interpreter::walk(const expr_index index)
+	{
+		const auto& node = pool_[index];
+		switch (node.kind)
+		{
+			case expr_kind::number: return expr_pool::number(node);
+			case expr_kind::variable: return variables_.find(expr_pool::name(node))->second;
+			case expr_kind::unary:
+			{
+				const auto operand = walk(node.operands[0]);
+				return call(session_.symbols.unary_operator(node.op), &operand, 1);
+			}
+			case expr_kind::binary:
+			{
+				const double ops[]{walk(node.operands[0]), walk(node.operands[1])};
+				switch (node.op)
+				{
+					case '+': return ops[0] + ops[1];
+					case '-': return ops[0] - ops[1];
+					case '*': return ops[0] * ops[1];
+					// fcmp ult, true if either side is NaN.
+					case '<': return !(ops[0] >= ops[1]) ? 1.0 : 0.0;
+					default: return call(session_.symbols.binary_operator(node.op), ops, 2);
+				}
+			}
+			case expr_kind::call:
+			{
+				const auto args = pool_.call_args(node);
+
+				std::array<double, max_arguments> values{};
+				for (std::size_t i = 0; i < args.size(); ++i) { values[i] = walk(args[i]); }
+				return call(expr_pool::name(node), values.data(), args.size());
+			}
+			case expr_kind::if_then_else:
+			{
+				const auto [cond, then, else_] = pool_.if_operands(node);
+				return walk(is_true(walk(cond)) ? then : else_);
+			}
+			case expr_kind::for_in:
+			{
+				const auto [var_name, init, end, step, body] = pool_.for_operands(node);
+
+				// Same order as the loop codegen emits: body, step, then the end condition,
+				// all with the variable still holding the value of this trip.
+				auto var = walk(init);
+
+				// If it shadows an existing variable, we have to restore it.
+				std::optional<double> shadowed;
+				if (const auto it = variables_.find(var_name); it != variables_.end()) { shadowed = it->second; }
+
+				while (true)
+				{
+					variables_[var_name] = var;
+
+					(void)walk(body);
+					const auto step_val = step == null_expr ? 1.0 : walk(step);
+					const auto end_cond = walk(end);
+
+					var += step_val;
+					if (!is_true(end_cond)) { break; }
+				}
+
+				if (shadowed) { variables_[var_name] = *shadowed; }
+				else { variables_.erase(var_name); }
+
+				// for expr always returns 0.0.
+				return 0.0;
+			}
+		}
+
+		return 0.0;
+	}
+}// namespace hello_llvm
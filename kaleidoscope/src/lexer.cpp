@@ -1,93 +1,176 @@
 #include <kaleidoscope/lexer.hpp>
 
-#include <cctype>
+#include <array>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <string>
 
 namespace hello_llvm
 {
-	int tokenizer::get_token()
+	namespace
 	{
-		static int last_char = ' ';
+		/// char_class - Bits classifying a byte, replacing the locale-aware <cctype>
+		/// calls the way the "C" locale would answer them.
+		enum char_class : std::uint8_t
+		{
+			cc_space	  = 1 << 0,
+			cc_ident_head = 1 << 1,// [a-zA-Z]
+			cc_ident_tail = 1 << 2,// [a-zA-Z0-9]
+			cc_number	  = 1 << 3,// [0-9.]
+		};
 
-		// Skip any whitespace.
-		while (std::isspace(last_char))
+		constexpr auto char_classes = []
 		{
-			last_char = std::getchar();
+			std::array<std::uint8_t, 256> table{};
+
+			for (const auto c: {' ', '\t', '\n', '\v', '\f', '\r'}) { table[static_cast<unsigned char>(c)] |= cc_space; }
+			for (auto c = 'a'; c <= 'z'; ++c) { table[static_cast<unsigned char>(c)] |= cc_ident_head | cc_ident_tail; }
+			for (auto c = 'A'; c <= 'Z'; ++c) { table[static_cast<unsigned char>(c)] |= cc_ident_head | cc_ident_tail; }
+			for (auto c = '0'; c <= '9'; ++c) { table[static_cast<unsigned char>(c)] |= cc_ident_tail | cc_number; }
+			table[static_cast<unsigned char>('.')] |= cc_number;
+
+			return table;
+		}();
+
+		/// is - Test a character returned by peek(), EOF maps to 0xff which is in no class.
+		[[nodiscard]] constexpr bool is(const int c, const char_class cls) noexcept
+		{
+			return char_classes[static_cast<unsigned char>(c)] & cls;
 		}
 
-		// identifier: [a-zA-Z][a-zA-Z0-9]*
-		if (std::isalpha(last_char))
+		struct keyword
 		{
-			identifier_str = static_cast<char>(last_char);
-			while (std::isalnum((last_char = std::getchar())))
-			{
-				identifier_str += static_cast<char>(last_char);
-			}
+			std::string_view spelling;
+			tokenizer::token token = tokenizer::tok_identifier;
+		};
 
-			if (identifier_str == "def")
-			{
-				return tok_def;
-			}
-			if (identifier_str == "extern")
-			{
-				return tok_extern;
-			}
-			if (identifier_str == "if")
-			{
-				return tok_if;
-			}
-			if (identifier_str == "then")
-			{
-				return tok_then;
-			}
-			if (identifier_str == "else")
-			{
-				return tok_else;
-			}
-			if (identifier_str == "for")
-			{
-				return tok_for;
-			}
-			if (identifier_str == "in")
-			{
-				return tok_in;
-			}
-			if (identifier_str == "binary")
+		constexpr std::array<keyword, 9> keywords{{
+				{"def", tokenizer::tok_def},
+				{"extern", tokenizer::tok_extern},
+				{"if", tokenizer::tok_if},
+				{"then", tokenizer::tok_then},
+				{"else", tokenizer::tok_else},
+				{"for", tokenizer::tok_for},
+				{"in", tokenizer::tok_in},
+				{"binary", tokenizer::tok_binary},
+				{"unary", tokenizer::tok_unary},
+		}};
+
+		constexpr std::size_t max_keyword_length = 6;
+
+		/// keyword_hash - Perfect over the keywords above, mixing only the first and last
+		/// characters with the length.  Anything longer than max_keyword_length is
+		/// rejected before hashing.
+		[[nodiscard]] constexpr std::size_t keyword_hash(const std::string_view str) noexcept
+		{
+			return (static_cast<unsigned char>(str.front()) * 4 + static_cast<unsigned char>(str.back()) * 9 + str.size()) & 15;
+		}
+
+		constexpr auto keyword_table = []
+		{
+			std::array<keyword, 16> table{};
+			for (const auto& k: keywords) { table[keyword_hash(k.spelling)] = k; }
+			return table;
+		}();
+
+		static_assert(
+				[]
+				{
+					for (const auto& k: keywords)
+					{
+						if (k.spelling.size() > max_keyword_length || keyword_table[keyword_hash(k.spelling)].token != k.token) { return false; }
+					}
+					return true;
+				}(),
+				"keyword_hash is no longer perfect, pick new multipliers");
+	}// namespace
+
+	tokenizer::tokenizer(symbol_table& symbols)
+		: tokenizer(symbols, std::make_unique<stdin_source>()) {}
+
+	tokenizer::tokenizer(symbol_table& symbols, std::unique_ptr<source> src)
+		: symbols_(symbols),
+		  source_(std::move(src)),
+		  cursor_(source_->begin()),
+		  token_begin_(source_->begin()),
+		  end_(source_->end()) {}
+
+	int tokenizer::peek()
+	{
+		if (cursor_ == end_)
+		{
+			// Keep the partially scanned token alive across the refill.
+			const auto scanned = cursor_ - token_begin_;
+			const auto more	   = source_->refill(token_begin_);
+			token_begin_	   = source_->begin();
+			cursor_			   = token_begin_ + scanned;
+			end_			   = source_->end();
+			if (!more) { return EOF; }
+		}
+
+		return static_cast<unsigned char>(*cursor_);
+	}
+
+	int tokenizer::get_token()
+	{
+		// Nothing before the cursor is needed any more, let a refill drop it.
+		token_begin_ = cursor_;
+
+		int last_char;
+		while (true)
+		{
+			// Skip any whitespace.
+			while (is(last_char = peek(), cc_space))
 			{
-				return tok_binary;
+				token_begin_ = ++cursor_;
 			}
-			if (identifier_str == "unary")
+
+			if (last_char != '#')
 			{
-				return tok_unary;
+				break;
 			}
-			return tok_identifier;
+
+			// Comment until end of line.
+			do {
+				token_begin_ = ++cursor_;
+				last_char	 = peek();
+			} while (last_char != EOF && last_char != '\n' && last_char != '\r');
 		}
 
-		// Number: [0-9.]+
-		if (std::isdigit(last_char) || last_char == '.')
+		// identifier: [a-zA-Z][a-zA-Z0-9]*
+		if (is(last_char, cc_ident_head))
 		{
-			std::string num_str;
-			do
+			do {
+				++cursor_;
+			} while (is(peek(), cc_ident_tail));
+
+			identifier_str = std::string_view{token_begin_, static_cast<std::size_t>(cursor_ - token_begin_)};
+
+			if (identifier_str.size() <= max_keyword_length)
 			{
-				num_str += static_cast<char>(last_char);
-				last_char = std::getchar();
-			} while (std::isdigit(last_char) || last_char == '.');
+				if (const auto& keyword = keyword_table[keyword_hash(identifier_str)]; keyword.spelling == identifier_str)
+				{
+					return keyword.token;
+				}
+			}
 
-			num_val = std::strtod(num_str.c_str(), nullptr);
-			return tok_number;
+			identifier_sym = symbols_.intern(identifier_str);
+			return tok_identifier;
 		}
 
-		if (last_char == '#')
+		// Number: [0-9.]+
+		if (is(last_char, cc_number))
 		{
-			// Comment until end of line.
 			do {
-				last_char = std::getchar();
-			} while (last_char != EOF && last_char != '\n' && last_char != '\r');
+				++cursor_;
+				last_char = peek();
+			} while (is(last_char, cc_number));
 
-			if (last_char != EOF)
-			{
-				return get_token();
-			}
+			// strtod needs a terminated string, short numbers stay in the SSO buffer.
+			const std::string num_str{token_begin_, cursor_};
+			num_val = std::strtod(num_str.c_str(), nullptr);
+			return tok_number;
 		}
 
 		// Check for end of file.  Don't eat the EOF.
@@ -97,8 +180,7 @@ namespace hello_llvm
 		}
 
 		// Otherwise, just return the character as its ascii value.
-		const auto this_char = last_char;
-		last_char	   = std::getchar();
-		return this_char;
+		++cursor_;
+		return last_char;
 	}
 }// namespace hello_llvm
@@ -0,0 +1,202 @@
+#include <kaleidoscope/linker.hpp>
+#include <kaleidoscope/parser.hpp>
+
+#include <kaleidoscope/details/KaleidoscopeAOT.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <llvm-12/llvm/ADT/STLExtras.h>
+#include <llvm-12/llvm/ADT/StringMap.h>
+#include <llvm-12/llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm-12/llvm/IR/LLVMContext.h>
+#include <llvm-12/llvm/IR/Module.h>
+#include <llvm-12/llvm/Support/ThreadPool.h>
+#include <llvm-12/llvm/Transforms/Utils/Cloning.h>
+#include <llvm-12/llvm/Transforms/Utils/ValueMapper.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+
+namespace hello_llvm
+{
+	void linker::add(std::string name, std::unique_ptr<source> input)
+	{
+		units_.push_back({std::move(name), std::move(input), nullptr, {}, {}, {}});
+	}
+
+	void linker::compile(unit& u)
+	{
+		parser p{*u.s, std::move(u.input)};
+
+		// As the prompt does, an item in error is reported and skipped.
+		p.run_all([&u](const top_level_item& item) {
+			if (item.name) { (item.token == tokenizer::tok_def ? u.definitions : u.externs).push_back(*item.name); }
+			return true;
+		});
+	}
+
+	bool linker::resolve() const
+	{
+		struct definition
+		{
+			const unit* by;
+			std::size_t arity;
+		};
+
+		llvm::StringMap<definition> definitions;
+		auto ok = true;
+		for (const auto& u: units_)
+		{
+			for (const auto id: u.definitions)
+			{
+				const auto name	 = u.s->symbols.name(id);
+				const auto arity = u.s->functions_proto.find(id)->second->get_args().size();
+
+				// The ids the unit was forked with are the library's, any past them are new
+				// to it.
+				if (library_.defined_functions.count(id))
+				{
+					std::cerr << "link error: " << name.str() << " is defined by " << u.name << ", but already defined\n";
+					ok = false;
+				}
+				else if (const auto [it, inserted] = definitions.try_emplace(name, definition{&u, arity}); !inserted)
+				{
+					std::cerr << "link error: " << name.str() << " is defined by both " << it->second.by->name << " and " << u.name << '\n';
+					ok = false;
+				}
+			}
+		}
+
+		for (const auto& u: units_)
+		{
+			for (const auto id: u.externs)
+			{
+				const auto name = u.s->symbols.name(id);
+				const auto it	= definitions.find(name);
+				// Otherwise it is up to the JIT to find, in the process.
+				if (it == definitions.end() || it->second.by == &u) { continue; }
+
+				if (const auto arity = u.s->functions_proto.find(id)->second->get_args().size(); arity != it->second.arity)
+				{
+					std::cerr << "link error: " << name.str() << " is declared with " << arity << " parameters by " << u.name
+							  << ", but defined with " << it->second.arity << " by " << it->second.by->name << '\n';
+					ok = false;
+				}
+			}
+		}
+
+		return ok;
+	}
+
+	void linker::merge()
+	{
+		for (const auto pass: {&unit::externs, &unit::definitions})
+		{
+			for (auto& u: units_)
+			{
+				// The unit's symbol ids are its own, past the ones it was forked with.
+				const auto rename = [&](const symbol_id id) { return library_.symbols.intern(u.s->symbols.name(id)); };
+
+				for (const auto id: u.*pass)
+				{
+					const auto name = rename(id);
+					const auto& p	= *u.s->functions_proto.find(id)->second;
+					if (pass == &unit::externs && (u.s->defined_functions.count(id) || library_.functions_proto.count(name))) { continue; }
+
+					std::vector<symbol_id> args;
+					std::transform(p.get_args().begin(), p.get_args().end(), std::back_inserter(args), rename);
+					const auto& merged = library_.insert_or_assign_function(
+						std::make_unique<prototype_ast>(name, std::move(args), p.is_unary() || p.is_binary(), p.get_precedence()));
+					if (pass == &unit::externs) { continue; }
+
+					library_.defined_functions.insert(name);
+					if (merged.is_binary()) { library_.add_bin_op_precedence(merged.get_operator_name(library_.symbols), merged.get_precedence()); }
+
+					if (const auto pure = u.s->pure_functions.find(id); pure != u.s->pure_functions.end())
+					{
+						auto body = std::make_unique<pure_function>(*pure->second);
+						body->pool.rename_symbols(rename);
+						library_.pure_functions[name] = std::move(body);
+					}
+				}
+			}
+		}
+	}
+
+	bool linker::link(const unsigned threads)
+	{
+		// Forked up front, the library session is left alone while the workers run.
+		for (auto& u: units_)
+		{
+			u.s						  = library_.fork();
+			u.s->dump_ir			  = false;
+			u.s->results			  = nullptr;
+			u.s->batch_definitions	  = true;
+			u.s->deferred_expressions = &u.expressions;
+		}
+
+		{
+			llvm::ThreadPool workers{llvm::hardware_concurrency(threads)};
+			for (auto& u: units_)
+			{
+				workers.async([&u] { compile(u); });
+			}
+			workers.wait();
+		}
+
+		if (!resolve())
+		{
+			units_.clear();
+			return false;
+		}
+
+		merge();
+
+		// The top-level expressions are split off into modules of their own, which are
+		// freed once they have run, and are no part of the program.
+		std::vector<llvm::orc::ThreadSafeModule> modules;
+		std::vector<llvm::orc::ThreadSafeModule> expressions;
+		for (auto& u: units_)
+		{
+			if (u.s->pending_definitions == 0) { continue; }
+
+			u.s->pending_definitions = 0;
+			auto [m, c]				 = u.s->refresh();
+			const llvm::orc::ThreadSafeContext context{std::move(c)};
+			if (!u.expressions.empty())
+			{
+				llvm::ValueToValueMapTy map;
+				expressions.emplace_back(llvm::CloneModule(*m, map, [&u](const llvm::GlobalValue* value) { return llvm::is_contained(u.expressions, value->getName()); }), context);
+				for (const auto& name: u.expressions) { m->getFunction(name)->eraseFromParent(); }
+			}
+
+			if (library_.aot) { library_.exit_on_error(library_.aot->addModule(*m)); }
+			modules.emplace_back(std::move(m), context);
+		}
+		library_.exit_on_error(library_.jit->addModules(std::move(modules), library_.tracker));
+
+		const auto tracker = library_.jit->getMainJITDylib().createResourceTracker();
+		for (auto& m: expressions) { library_.exit_on_error(library_.jit->addTransientModule(std::move(m), tracker)); }
+
+		// As the prompt does, an expression that fails is reported and the others run.
+		for (const auto& u: units_)
+		{
+			for (const auto& name: u.expressions)
+			{
+				auto expr = library_.jit->lookup(name);
+				if (!expr)
+				{
+					llvm::logAllUnhandledErrors(expr.takeError(), llvm::errs(), "Error: ");
+					library_.print_failure();
+					continue;
+				}
+				library_.print_result(reinterpret_cast<double (*)()>(static_cast<std::intptr_t>(expr->getAddress()))());
+			}
+		}
+		library_.exit_on_error(tracker->remove());
+
+		units_.clear();
+		return true;
+	}
+}// namespace hello_llvm
@@ -1,6 +1,9 @@
 #include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/expression_cache.hpp>
+#include <kaleidoscope/folder.hpp>
+#include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/pipeline.hpp>
 
-#include <iomanip>
 #include <iostream>
 
 #include <llvm-12/llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
@@ -8,46 +11,66 @@
 
 namespace hello_llvm
 {
-	std::unique_ptr<expr_ast> parser::parse_number_expr()
+	namespace
 	{
-		auto result = std::make_unique<number_expr_ast>(tok_.num_val);
+		/// print_ir - Show what an item code generated to, if session::dump_ir is set.
+		void print_ir(const session& s, const char* what, const llvm::Function& func)
+		{
+			if (!s.dump_ir) { return; }
+
+			std::cerr << "Read " << what << ": \n";
+			func.print(llvm::errs());
+			std::cerr << '\n';
+		}
+
+		/// print_result - Show the value of a top-level expression, and pass it on.
+		double print_result(const session& s, const double value)
+		{
+			s.print_result(value);
+			return value;
+		}
+	}// namespace
+
+	expr_index parser::parse_number_expr()
+	{
+		const auto result = pool_.add_number(tok_.num_val);
 		get_next_token();// consume the number
 		return result;
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_paren_expr()
+	expr_index parser::parse_paren_expr()
 	{
 		get_next_token();// eat (
-		auto v = parse_expression();
-		if (!v) { return nullptr; }
+		const auto v = parse_expression();
+		if (v == null_expr) { return null_expr; }
 
 		if (curr_tok_ != ')') { return log_error("expected ')'"); }
 		get_next_token();// eat )
 		return v;
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_identifier_expr()
+	expr_index parser::parse_identifier_expr()
 	{
-		std::string id_name = tok_.identifier_str;
+		const auto id_name = tok_.identifier_sym;
 
 		get_next_token();// eat identifier.
 
 		if (curr_tok_ != '(')
 		{
 			// Simple variable ref.
-			return std::make_unique<variable_expr_ast>(id_name);
+			return pool_.add_variable(id_name);
 		}
 
 		// Call
 		get_next_token();// eat (
 
-		std::vector<std::unique_ptr<expr_ast>> args;
+		llvm::SmallVector<expr_index, 8> args;
 		if (curr_tok_ != ')')
 		{
 			while (true)
 			{
-				if (auto arg = parse_expression(); arg) { args.push_back(std::move(arg)); }
-				else { return nullptr; }
+				if (const auto arg = parse_expression(); arg != null_expr) { args.push_back(arg); }
+				else { return null_expr; }
 
 				if (curr_tok_ == ')') { break; }
 
@@ -59,42 +82,42 @@ namespace hello_llvm
 
 		// Eat the ')'
 		get_next_token();
-		return std::make_unique<call_expr_ast>(id_name, std::move(args));
+		return pool_.add_call(id_name, args);
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_if_expr()
+	expr_index parser::parse_if_expr()
 	{
 		get_next_token();// eat the if
 
 		// condition.
-		auto cond = parse_expression();
-		if (!cond) { return nullptr; }
+		const auto cond = parse_expression();
+		if (cond == null_expr) { return null_expr; }
 
 		if (curr_tok_ != tokenizer::tok_then) { return log_error("expected then"); }
 
 		get_next_token();// eat the then
 
 		// then
-		auto then = parse_expression();
-		if (!then) { return nullptr; }
+		const auto then = parse_expression();
+		if (then == null_expr) { return null_expr; }
 
 		if (curr_tok_ != tokenizer::tok_else) { return log_error("expected else"); }
 
 		get_next_token();// eat the else
 
-		auto else_ = parse_expression();
-		if (!else_) { return nullptr; }
+		const auto else_ = parse_expression();
+		if (else_ == null_expr) { return null_expr; }
 
-		return std::make_unique<if_expr_ast>(std::move(cond), std::move(then), std::move(else_));
+		return pool_.add_if(cond, then, else_);
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_for_expr()
+	expr_index parser::parse_for_expr()
 	{
 		get_next_token();// eat the for
 
 		if (curr_tok_ != tokenizer::tok_identifier) { return log_error("expected identifier after for"); }
 
-		std::string cond_var = tok_.identifier_str;
+		const auto cond_var = tok_.identifier_sym;
 
 		get_next_token();// eat identifier
 
@@ -102,41 +125,41 @@ namespace hello_llvm
 
 		get_next_token();// eat '='
 
-		auto init = parse_expression();
-		if (!init) { return nullptr; }
+		const auto init = parse_expression();
+		if (init == null_expr) { return null_expr; }
 
 		if (curr_tok_ != ',') { return log_error("expected ',' after for init value"); }
 
 		get_next_token();// eat end
 
-		auto end = parse_expression();
-		if (!end) { return nullptr; }
+		const auto end = parse_expression();
+		if (end == null_expr) { return null_expr; }
 
 		// The step value is optional
-		std::unique_ptr<expr_ast> step;
+		auto step = null_expr;
 		if (curr_tok_ == ',')
 		{
 			get_next_token();
 			step = parse_expression();
-			if (!step) { return nullptr; }
+			if (step == null_expr) { return null_expr; }
 		}
 
 		if (curr_tok_ != tokenizer::tok_in) { return log_error("expected 'in' after for"); }
 
 		get_next_token();// eat 'in'
 
-		auto body = parse_expression();
-		if (!body) { return nullptr; }
+		const auto body = parse_expression();
+		if (body == null_expr) { return null_expr; }
 
-		return std::make_unique<for_expr_ast>(
-				std::move(cond_var),
-				std::move(init),
-				std::move(end),
-				std::move(step),
-				std::move(body));
+		return pool_.add_for(
+				cond_var,
+				init,
+				end,
+				step,
+				body);
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_primary()
+	expr_index parser::parse_primary()
 	{
 		switch (curr_tok_)
 		{
@@ -149,7 +172,7 @@ namespace hello_llvm
 		}
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_unary_op()
+	expr_index parser::parse_unary_op()
 	{
 		// If the current token is not an operator, it must be a primary expr.
 		if (!isascii(curr_tok_) || curr_tok_ == '(' || curr_tok_ == ',')
@@ -160,19 +183,19 @@ namespace hello_llvm
 		// If this is a unary operator, read it.
 		auto op = curr_tok_;
 		get_next_token();
-		if (auto operand = parse_unary_op(); operand)
+		if (const auto operand = parse_unary_op(); operand != null_expr)
 		{
-			return std::make_unique<unary_expr_ast>(op, std::move(operand));
+			return pool_.add_unary(static_cast<char>(op), operand);
 		}
-		return nullptr;
+		return null_expr;
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_bin_op_rhs(const int expr_prec, std::unique_ptr<expr_ast> lhs)
+	expr_index parser::parse_bin_op_rhs(const int expr_prec, expr_index lhs)
 	{
 		// If this is a bin_op, find its precedence.
 		while (true)
 		{
-			const auto tok_prec = global_context::get_token_precedence(curr_tok_);
+			const auto tok_prec = session_.get_token_precedence(curr_tok_);
 
 			// If this is a bin_op that binds at least as tightly as the current bin_op,
 			// consume it, otherwise we are done.
@@ -184,28 +207,28 @@ namespace hello_llvm
 
 			// Parse the unary expression after the binary operator.
 			auto rhs = parse_unary_op();
-			if (!rhs) { return nullptr; }
+			if (rhs == null_expr) { return null_expr; }
 
 			// If bin_op binds less tightly with RHS than the operator after RHS, let
 			// the pending operator take RHS as its lhs.
-			const auto next_prec = global_context::get_token_precedence(curr_tok_);
+			const auto next_prec = session_.get_token_precedence(curr_tok_);
 			if (tok_prec < next_prec)
 			{
-				rhs = parse_bin_op_rhs(tok_prec + 1, std::move(rhs));
-				if (!rhs) { return nullptr; }
+				rhs = parse_bin_op_rhs(tok_prec + 1, rhs);
+				if (rhs == null_expr) { return null_expr; }
 			}
 
 			// Merge lhs/rhs.
-			lhs = std::make_unique<binary_expr_ast>(bin_op, std::move(lhs), std::move(rhs));
+			lhs = pool_.add_binary(static_cast<char>(bin_op), lhs, rhs);
 		}
 	}
 
-	std::unique_ptr<expr_ast> parser::parse_expression()
+	expr_index parser::parse_expression()
 	{
-		auto lhs = parse_unary_op();
-		if (!lhs) { return nullptr; }
+		const auto lhs = parse_unary_op();
+		if (lhs == null_expr) { return null_expr; }
 
-		return parse_bin_op_rhs(0, std::move(lhs));
+		return parse_bin_op_rhs(0, lhs);
 	}
 
 	std::unique_ptr<prototype_ast> parser::parse_prototype()
@@ -217,7 +240,7 @@ namespace hello_llvm
 			binary = 2
 		};
 
-		std::string func_name;
+		symbol_id func_name;
 		operator_kind kind;
 		int			precedence = 30;
 
@@ -226,7 +249,7 @@ namespace hello_llvm
 			default:
 				return log_error_p("expected function name in prototype");
 			case tokenizer::tok_identifier:
-				func_name = tok_.identifier_str;
+				func_name = tok_.identifier_sym;
 				kind	  = operator_kind::identifier;
 				get_next_token();
 				break;
@@ -236,8 +259,7 @@ namespace hello_llvm
 				{
 					return log_error_p("expected unary operator");
 				}
-				func_name = "unary";
-				func_name.push_back(static_cast<char>(curr_tok_));
+				func_name = session_.symbols.unary_operator(static_cast<char>(curr_tok_));
 				kind = operator_kind::unary;
 				get_next_token();
 				break;
@@ -247,8 +269,7 @@ namespace hello_llvm
 				{
 					return log_error_p("expected binary operator");
 				}
-				func_name = "binary";
-				func_name.push_back(static_cast<char>(curr_tok_));
+				func_name = session_.symbols.binary_operator(static_cast<char>(curr_tok_));
 				kind = operator_kind::binary;
 				get_next_token();
 
@@ -267,8 +288,8 @@ namespace hello_llvm
 
 		if (curr_tok_ != '(') { return log_error_p("expected '(' in prototype"); }
 
-		std::vector<std::string> arg_names;
-		while (get_next_token() == tokenizer::tok_identifier) { arg_names.push_back(tok_.identifier_str); }
+		std::vector<symbol_id> arg_names;
+		while (get_next_token() == tokenizer::tok_identifier) { arg_names.push_back(tok_.identifier_sym); }
 
 		if (curr_tok_ != ')') { return log_error_p("expected ')' in prototype"); }
 
@@ -290,17 +311,17 @@ namespace hello_llvm
 		auto proto = parse_prototype();
 		if (!proto) { return nullptr; }
 
-		if (auto e = parse_expression(); e) { return std::make_unique<function_ast>(std::move(proto), std::move(e)); }
+		if (const auto e = parse_expression(); e != null_expr) { return std::make_unique<function_ast>(std::move(proto), pool_, e); }
 		return nullptr;
 	}
 
 	std::unique_ptr<function_ast> parser::parse_top_level_expr()
 	{
-		if (auto e = parse_expression(); e)
+		if (const auto e = parse_expression(); e != null_expr)
 		{
 			// Make an anonymous proto
-			auto proto = std::make_unique<prototype_ast>("__anon_expr__", std::vector<std::string>());
-			return std::make_unique<function_ast>(std::move(proto), std::move(e));
+			auto proto = std::make_unique<prototype_ast>(session_.symbols.intern("__anon_expr__"), std::vector<symbol_id>());
+			return std::make_unique<function_ast>(std::move(proto), pool_, e);
 		}
 		return nullptr;
 	}
@@ -311,19 +332,22 @@ namespace hello_llvm
 		return parse_prototype();
 	}
 
-	void parser::handle_definition()
+	std::optional<symbol_id> parser::handle_definition()
 	{
+		std::optional<symbol_id> defined;
+
 		if (const auto func_ast = parse_definition(); func_ast)
 		{
-			if (auto* func_ir = func_ast->codegen(); func_ir)
+			const auto name = func_ast->get_proto().get_name();
+			constant_folder{session_, pool_}.fold(func_ast->get_body());
+
+			if (auto* func_ir = func_ast->codegen(session_); func_ir)
 			{
-				std::cerr << "Read function definition: \n";
-				func_ir->print(llvm::errs());
-				std::cerr << '\n';
+				print_ir(session_, "function definition", *func_ir);
 
-				const auto& context = global_context::get();
-				auto [m, c] = global_context::refresh();
-				context.exit_on_error(context.jit->addModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(c))));
+				constant_folder::record_function(session_, name, pool_, func_ast->get_body());
+				session_.add_definition();
+				defined = name;
 			}
 		}
 		else
@@ -331,19 +355,20 @@ namespace hello_llvm
 			// Skip token for error recovery.
 			get_next_token();
 		}
+
+		pool_.reset();
+		return defined;
 	}
 
-	void parser::handle_extern()
+	std::optional<symbol_id> parser::handle_extern()
 	{
 		if (auto proto_ast = parse_extern(); proto_ast)
 		{
-			if (auto* func_ir = proto_ast->codegen(); func_ir)
+			if (auto* func_ir = proto_ast->codegen(session_); func_ir)
 			{
-				std::cerr << "Read extern: \n";
-				func_ir->print(llvm::errs());
-				std::cerr << '\n';
+				print_ir(session_, "extern", *func_ir);
 
-				global_context::insert_or_assign_function(std::move(proto_ast));
+				return session_.insert_or_assign_function(std::move(proto_ast)).get_name();
 			}
 		}
 		else
@@ -351,38 +376,115 @@ namespace hello_llvm
 			// Skip token for error recovery.
 			get_next_token();
 		}
+
+		return std::nullopt;
 	}
 
-	void parser::handle_top_level_expression()
+	std::optional<double> parser::handle_top_level_expression()
 	{
-		auto& context = global_context::get();
+		std::optional<double> value;
+
 		// Evaluate a top-level expression into an anonymous function.
 		if (const auto func_ast = parse_top_level_expr(); func_ast)
 		{
-			if (auto* func_ir = func_ast->codegen(); func_ir)
+			// Kept with the definitions, which may not even be callable yet.
+			if (session_.deferred_expressions)
+			{
+				constant_folder{session_, pool_}.fold(func_ast->get_body());
+				if (auto* func_ir = func_ast->codegen(session_); func_ir)
+				{
+					auto name = session_.expressions->next_name();
+					func_ir->setName(name);
+					const auto anon = session_.symbols.intern("__anon_expr__");
+					session_.defined_functions.erase(anon);
+					session_.module_functions.erase(anon);
+
+					print_ir(session_, "top-level expression", *func_ir);
+
+					session_.deferred_expressions->push_back(std::move(name));
+					session_.add_definition();
+				}
+
+				pool_.reset();
+				return value;
+			}
+
+			// A constant expression is done with here, it never reaches the JIT.
+			if (constant_folder{session_, pool_}.fold(func_ast->get_body()))
+			{
+				value = expr_pool::number(pool_[func_ast->get_body()]);
+				pool_.reset();
+
+				// Printed in its turn, after the expressions still in the pipeline.
+				if (session_.pipeline) { session_.pipeline->post(*value); }
+				else { print_result(session_, *value); }
+				return value;
+			}
+
+			// The expression is about to call into the pending definitions, and its own
+			// module is thrown away after running, so it cannot share their module.
+			session_.flush_definitions();
+
+			// Most expressions typed at the prompt are cheaper to walk than to compile.
+			if (interpreter interp{session_, pool_}; session_.interpret_expressions && !session_.pipeline && interp.worth_interpreting(func_ast->get_body()))
+			{
+				if (const auto result = interp.evaluate(func_ast->get_body()); result) { value = print_result(session_, *result); }
+				else { session_.print_failure(); }
+			}
+			// The same expression as an earlier one runs the code compiled back then.
+			else if (const auto cached = session_.pipeline ? nullptr : session_.expressions->find(pool_, func_ast->get_body()); cached)
 			{
-				std::cerr << "Read top-level expression: \n";
-				func_ir->print(llvm::errs());
-				std::cerr << '\n';
+				value = print_result(session_, cached());
+			}
+			else if (auto* func_ir = func_ast->codegen(session_); func_ir)
+			{
+				// The compiled expression stays alive in the cache, under a name of its own,
+				// which leaves the anonymous one free for the next expression.
+				const auto name = session_.expressions->next_name();
+				func_ir->setName(name);
+				session_.defined_functions.erase(session_.symbols.intern("__anon_expr__"));
+
+				print_ir(session_, "top-level expression", *func_ir);
 
 				// Create a ResourceTracker to track JIT 'd memory allocated to our
-				// anonymous expression -- that way we can free it after executing.
-				const auto rt = context.jit->getMainJITDylib().createResourceTracker();
+				// anonymous expression -- that way we can free it once evicted.
+				auto rt = session_.jit->getMainJITDylib().createResourceTracker();
 				
-				auto [m, c]	  = global_context::refresh();
+				auto [m, c]	  = session_.refresh();
 				auto tsm = llvm::orc::ThreadSafeModule(std::move(m), std::move(c));
-				context.exit_on_error(context.jit->addModule(std::move(tsm), rt));
+				if (auto err = session_.jit->addTransientModule(std::move(tsm), rt))
+				{
+					llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), "Error: ");
+					pool_.reset();
+					return value;
+				}
+
+				// The pipeline runs it once compiled, and then frees it.
+				if (session_.pipeline)
+				{
+					session_.pipeline->post(name, std::move(rt));
+					pool_.reset();
+					return value;
+				}
 
-				// Search the JIT for the __anon_expr__ symbol.
-				const auto expr = context.exit_on_error(context.jit->lookup("__anon_expr__"));
+				// Search the JIT for the anonymous expression's symbol, which fails if it
+				// calls a function that is only declared. The expression is freed then.
+				auto expr = session_.jit->lookup(name);
+				if (!expr)
+				{
+					llvm::logAllUnhandledErrors(expr.takeError(), llvm::errs(), "Error: ");
+					session_.exit_on_error(rt->remove());
+					session_.print_failure();
+					pool_.reset();
+					return value;
+				}
 
 				// Get the symbol's address and cast it to the right type (takes no
 				// arguments, returns a double) so we can call it as a native function.
-				const auto fp = reinterpret_cast<double(*)()>(static_cast<std::intptr_t>(expr.getAddress()));
-				std::cerr << "\nEvaluated to -->" << std::setw(8) << std::setprecision(3) << fp() << "\n\n";
+				const auto fp = reinterpret_cast<double(*)()>(static_cast<std::intptr_t>(expr->getAddress()));
+				value = print_result(session_, fp());
 
-				// Delete the anonymous expression module from the JIT.
-				context.exit_on_error(rt->remove());
+				session_.expressions->insert(std::move(rt), fp);
 			}
 		}
 		else
@@ -390,5 +492,39 @@ namespace hello_llvm
 			// Skip token for error recovery.
 			get_next_token();
 		}
+
+		pool_.reset();
+		return value;
+	}
+
+	bool parser::run_all(const llvm::function_ref<bool(const top_level_item&)> on_item, const llvm::function_ref<bool(int)> on_start)
+	{
+		get_next_token();
+		while (curr_tok_ != tokenizer::tok_eof)
+		{
+			const auto token = curr_tok_;
+			if (token == ';')
+			{
+				get_next_token();
+				continue;
+			}
+			if (on_start && !on_start(token)) { return false; }
+
+			top_level_item item{token, std::nullopt, std::nullopt};
+			switch (token)
+			{
+				case tokenizer::tok_def:
+					item.name = handle_definition();
+					break;
+				case tokenizer::tok_extern:
+					item.name = handle_extern();
+					break;
+				default:
+					item.value = handle_top_level_expression();
+					break;
+			}
+			if (!on_item(item)) { return false; }
+		}
+		return true;
 	}
 }// namespace hello_llvm
@@ -0,0 +1,60 @@
+#include <kaleidoscope/pipeline.hpp>
+
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <cstdint>
+
+namespace hello_llvm
+{
+	expression_pipeline::expression_pipeline(session& s, const std::size_t capacity)
+		: session_(s),
+		  jobs_(capacity),
+		  thread_([this] { run(); }) {}
+
+	expression_pipeline::~expression_pipeline()
+	{
+		finish();
+	}
+
+	void expression_pipeline::run()
+	{
+		while (auto j = jobs_.pop())
+		{
+			if (!j->name.empty())
+			{
+				// Waits for the compile threads to be done with it. Fails if it calls a
+				// function that is only declared, which leaves the queue going on.
+				auto expr = session_.jit->lookup(j->name);
+				if (expr) { j->value = reinterpret_cast<double (*)()>(static_cast<std::intptr_t>(expr->getAddress()))(); }
+				else { llvm::logAllUnhandledErrors(expr.takeError(), llvm::errs(), "Error: "); }
+
+				if (auto err = j->tracker->remove()) { llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), "Error: "); }
+				if (!expr)
+				{
+					session_.print_failure();
+					continue;
+				}
+			}
+
+			session_.print_result(j->value);
+		}
+	}
+
+	void expression_pipeline::post(const double value)
+	{
+		jobs_.push({value, {}, nullptr});
+	}
+
+	void expression_pipeline::post(std::string name, llvm::orc::ResourceTrackerSP tracker)
+	{
+		jobs_.push({0.0, std::move(name), std::move(tracker)});
+	}
+
+	void expression_pipeline::finish()
+	{
+		if (!thread_.joinable()) { return; }
+
+		jobs_.close();
+		thread_.join();
+	}
+}// namespace hello_llvm
@@ -0,0 +1,295 @@
+#include <kaleidoscope/server.hpp>
+#include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/details/KaleidoscopeJIT.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+#ifndef _WIN32
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+#endif
+
+namespace hello_llvm
+{
+	namespace
+	{
+		/// stop_requested - Set by SIGINT and SIGTERM while the server runs.
+		std::atomic<bool> stop_requested{false};
+
+		void request_stop(int)
+		{
+			stop_requested.store(true);
+		}
+
+		/// percentile - Nearest rank, of sorted samples.
+		std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds>& sorted, const double p)
+		{
+			const auto rank = static_cast<std::size_t>(std::ceil(p * static_cast<double>(sorted.size())));
+			return sorted[std::max<std::size_t>(rank, 1) - 1];
+		}
+	}// namespace
+
+	server::server(session& library, const unsigned workers, const std::uint64_t step_limit)
+		: step_limit_(step_limit)
+	{
+		// Forked up front, so that the library session is left alone once they run.
+		for (unsigned i = 0; i < std::max(workers, 1u); ++i)
+		{
+			auto s	   = library.fork();
+			s->dump_ir = false;
+			s->results = nullptr;
+			sessions_.push_back(std::move(s));
+		}
+
+		for (auto& worker_session: sessions_)
+		{
+			workers_.emplace_back([this, &s = *worker_session] { work(s); });
+		}
+	}
+
+	server::~server()
+	{
+		{
+			std::lock_guard lock{queue_mutex_};
+			closing_ = true;
+		}
+		queue_ready_.notify_all();
+
+		for (auto& worker: workers_) { worker.join(); }
+	}
+
+	void server::work(session& s)
+	{
+		while (true)
+		{
+			request r;
+			{
+				std::unique_lock lock{queue_mutex_};
+				queue_ready_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+				if (queue_.empty()) { return; }
+
+				r = std::move(queue_.front());
+				queue_.pop_front();
+			}
+
+			r.response.set_value(evaluate(s, std::move(r.text)));
+		}
+	}
+
+	std::string server::evaluate(session& s, std::string text) const
+	{
+		parser p{s, std::make_unique<string_source>(std::move(text))};
+
+		// A budget for the whole request, however many expressions it has.
+		llvm::orc::KaleidoscopeJIT::limitThreadSteps(step_limit_);
+
+		std::ostringstream values;
+		values << std::setprecision(std::numeric_limits<double>::digits10);
+
+		auto first = true;
+		const char* error = nullptr;
+		p.run_all(
+			[&](const top_level_item& item) {
+				if (llvm::orc::KaleidoscopeJIT::threadStepsExhausted()) { error = "error: step limit exceeded"; }
+				else if (!item.value) { error = "error"; }
+				else
+				{
+					values << (first ? "" : " ") << *item.value;
+					first = false;
+				}
+				return error == nullptr;
+			},
+			[&](const int token) {
+				// Whatever a client defined would clash with the other clients' definitions.
+				if (token == tokenizer::tok_def || token == tokenizer::tok_extern) { error = "error: functions are only defined by the library"; }
+				return error == nullptr;
+			});
+
+		return error ? error : values.str();
+	}
+
+	std::string server::submit(std::string text)
+	{
+		std::promise<std::string> response;
+		auto result = response.get_future();
+		{
+			std::lock_guard lock{queue_mutex_};
+			queue_.push_back({std::move(text), std::move(response)});
+		}
+		queue_ready_.notify_one();
+
+		return result.get();
+	}
+
+#ifdef _WIN32
+	void server::serve_client(int) {}
+
+	bool server::run(const std::string&)
+	{
+		std::cerr << "Error: the server needs UNIX domain sockets, not available on this platform\n";
+		return false;
+	}
+#else
+	void server::serve_client(const int fd)
+	{
+		const auto reply = [fd](std::string response) {
+			response.push_back('\n');
+			for (std::size_t sent = 0; sent < response.size();)
+			{
+				// No SIGPIPE if the client hung up without waiting for the response.
+				const auto n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+				if (n <= 0) { break; }
+				sent += static_cast<std::size_t>(n);
+			}
+		};
+
+		std::string pending;
+		// skipping - The rest of a request too long to take is dropped, up to its newline.
+		auto skipping = false;
+		char buffer[4096];
+		while (true)
+		{
+			const auto read = ::recv(fd, buffer, sizeof(buffer), 0);
+			if (read <= 0) { break; }
+			pending.append(buffer, static_cast<std::size_t>(read));
+
+			// Requests are answered in order, one at a time per client.
+			std::size_t line_begin = 0;
+			for (auto line_end = pending.find('\n'); line_end != std::string::npos; line_end = pending.find('\n', line_begin))
+			{
+				if (skipping)
+				{
+					skipping   = false;
+					line_begin = line_end + 1;
+					continue;
+				}
+
+				const auto received = std::chrono::steady_clock::now();
+				auto response		= line_end - line_begin > max_request_size ? std::string{"error: request too long"} : submit(pending.substr(line_begin, line_end - line_begin));
+				const auto latency	= std::chrono::steady_clock::now() - received;
+				{
+					std::lock_guard lock{stats_mutex_};
+					latencies_.push_back(latency);
+				}
+				reply(std::move(response));
+
+				line_begin = line_end + 1;
+			}
+			pending.erase(0, line_begin);
+
+			// Answered before its end is even read, rather than buffered without bound.
+			if (skipping) { pending.clear(); }
+			else if (pending.size() > max_request_size)
+			{
+				reply("error: request too long");
+				pending.clear();
+				skipping = true;
+			}
+		}
+
+		std::lock_guard lock{clients_mutex_};
+		::close(fd);
+		client_fds_.erase(std::find(client_fds_.begin(), client_fds_.end(), fd));
+		if (client_fds_.empty()) { clients_done_.notify_all(); }
+	}
+
+	bool server::run(const std::string& path)
+	{
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path))
+		{
+			std::cerr << "Error: socket path '" << path << "' is too long\n";
+			return false;
+		}
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		// A socket left behind by an earlier run that did not get to remove it.
+		if (struct stat st{}; ::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) { ::unlink(path.c_str()); }
+
+		const auto listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listener < 0 ||
+			::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+			::listen(listener, SOMAXCONN) != 0)
+		{
+			std::cerr << "Error: cannot listen on '" << path << "': " << std::strerror(errno) << '\n';
+			if (listener >= 0) { ::close(listener); }
+			return false;
+		}
+
+		stop_requested.store(false);
+		const auto previous_int	 = std::signal(SIGINT, request_stop);
+		const auto previous_term = std::signal(SIGTERM, request_stop);
+
+		const auto start = std::chrono::steady_clock::now();
+		while (!stop_requested.load())
+		{
+			// Wakes up now and then to notice a stop request, whichever thread got the signal.
+			pollfd listening{listener, POLLIN, 0};
+			if (::poll(&listening, 1, 100) <= 0) { continue; }
+
+			const auto fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0) { continue; }
+
+			{
+				std::lock_guard lock{clients_mutex_};
+				if (client_fds_.size() >= max_clients)
+				{
+					constexpr char busy[] = "error: too many clients\n";
+					(void)::send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+					::close(fd);
+					continue;
+				}
+				client_fds_.push_back(fd);
+			}
+			std::thread{[this, fd] { serve_client(fd); }}.detach();
+		}
+
+		::close(listener);
+		::unlink(path.c_str());
+
+		// Hang up on the clients still connected, once their request in flight is answered.
+		{
+			std::unique_lock lock{clients_mutex_};
+			for (const auto fd: client_fds_) { ::shutdown(fd, SHUT_RD); }
+			clients_done_.wait(lock, [this] { return client_fds_.empty(); });
+		}
+		uptime_ = std::chrono::steady_clock::now() - start;
+
+		std::signal(SIGINT, previous_int);
+		std::signal(SIGTERM, previous_term);
+		return true;
+	}
+#endif
+
+	void server::print_stats(std::ostream& os)
+	{
+		std::lock_guard lock{stats_mutex_};
+
+		const auto seconds = std::chrono::duration<double>(uptime_).count();
+		os << "server: " << latencies_.size() << " requests in " << std::fixed << std::setprecision(2) << seconds << " s";
+		if (seconds > 0) { os << ", " << std::setprecision(1) << static_cast<double>(latencies_.size()) / seconds << " requests/s"; }
+
+		if (!latencies_.empty())
+		{
+			std::sort(latencies_.begin(), latencies_.end());
+
+			const auto micros = [](const std::chrono::nanoseconds latency) { return std::chrono::duration<double, std::micro>(latency).count(); };
+			os << ", latency p50 " << std::setprecision(1) << micros(percentile(latencies_, 0.50))
+			   << " us, p99 " << micros(percentile(latencies_, 0.99)) << " us";
+		}
+		os << '\n' << std::defaultfloat;
+	}
+}// namespace hello_llvm
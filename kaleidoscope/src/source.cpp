@@ -0,0 +1,87 @@
+#include <kaleidoscope/source.hpp>
+
+#include <llvm-12/llvm/Support/MemoryBuffer.h>
+
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+namespace hello_llvm
+{
+	// out-of-line virtual method
+	source::~source() = default;
+
+	string_source::string_source(std::string str)
+		: storage_(std::move(str))
+	{
+		begin_ = storage_.data();
+		end_   = storage_.data() + storage_.size();
+	}
+
+	mapped_file_source::mapped_file_source(std::unique_ptr<llvm::MemoryBuffer> buffer)
+		: buffer_(std::move(buffer))
+	{
+		begin_ = buffer_->getBufferStart();
+		end_   = buffer_->getBufferEnd();
+	}
+
+	mapped_file_source::~mapped_file_source() = default;
+
+	std::unique_ptr<mapped_file_source> mapped_file_source::open(const std::string& filename)
+	{
+		// We never read past end(), so there is no need for a null terminator, which
+		// in turn lets MemoryBuffer map the file instead of copying it.
+		auto buffer = llvm::MemoryBuffer::getFile(filename, -1, false);
+		if (!buffer)
+		{
+			std::cerr << "Error: cannot open '" << filename << "': " << buffer.getError().message() << '\n';
+			return nullptr;
+		}
+
+		return std::unique_ptr<mapped_file_source>{new mapped_file_source{std::move(*buffer)}};
+	}
+
+	stdin_source::stdin_source(const std::size_t chunk_size)
+		: buffer_(chunk_size)
+	{
+		begin_ = buffer_.data();
+		end_   = buffer_.data();
+	}
+
+	bool stdin_source::refill(const char* keep)
+	{
+		if (eof_)
+		{
+			begin_ = keep;
+			return false;
+		}
+
+		// Slide the bytes the tokenizer still needs to the front of the buffer, and
+		// grow it if they alone fill it up.
+		const auto kept = static_cast<std::size_t>(end_ - keep);
+		std::memmove(buffer_.data(), keep, kept);
+		if (kept == buffer_.size()) { buffer_.resize(buffer_.size() * 2); }
+
+		#ifdef _WIN32
+		const auto read = ::_read(0, buffer_.data() + kept, static_cast<unsigned>(buffer_.size() - kept));
+		#else
+		const auto read = ::read(STDIN_FILENO, buffer_.data() + kept, buffer_.size() - kept);
+		#endif
+
+		begin_ = buffer_.data();
+		end_   = buffer_.data() + kept;
+		if (read <= 0)
+		{
+			eof_ = true;
+			return false;
+		}
+
+		end_ += read;
+		return true;
+	}
+}// namespace hello_llvm
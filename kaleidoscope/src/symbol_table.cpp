@@ -0,0 +1,40 @@
+#include <kaleidoscope/symbol_table.hpp>
+
+#include <string>
+
+namespace hello_llvm
+{
+	symbol_table::symbol_table()
+	{
+		unary_operators_.fill(invalid_symbol);
+		binary_operators_.fill(invalid_symbol);
+	}
+
+	symbol_table::symbol_table(const symbol_table& other)
+		: unary_operators_(other.unary_operators_),
+		  binary_operators_(other.binary_operators_)
+	{
+		// Interned in id order, names_ cannot just be copied, it views other's keys.
+		names_.reserve(other.names_.size());
+		for (const auto name: other.names_) { (void)intern({name.data(), name.size()}); }
+	}
+
+	symbol_id symbol_table::intern(const std::string_view name)
+	{
+		const auto [it, inserted] = ids_.try_emplace({name.data(), name.size()}, static_cast<symbol_id>(names_.size()));
+		if (inserted) { names_.push_back(it->getKey()); }
+		return it->getValue();
+	}
+
+	symbol_id symbol_table::operator_symbol(std::array<symbol_id, 128>& cache, const std::string_view prefix, const char op)
+	{
+		auto& id = cache[static_cast<unsigned char>(op)];
+		if (id == invalid_symbol)
+		{
+			std::string name{prefix};
+			name.push_back(op);
+			id = intern(name);
+		}
+		return id;
+	}
+}// namespace hello_llvm